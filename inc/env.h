@@ -39,6 +39,34 @@ enum EnvType {
 	ENV_TYPE_NS, // Network server
 };
 
+// Scheduling classes.  Real-time envs always run before fair ones.
+enum EnvSchedClass {
+	ENV_SCHED_FAIR = 0,
+	ENV_SCHED_RT,
+};
+
+// Range of env_priority, from most to least favoured.
+#define ENV_PRIO_MIN (-20)
+#define ENV_PRIO_MAX 19
+
+// An env's x87, MMX and SSE registers, in FXSAVE format.
+struct FpuState {
+	uint16_t fs_fcw;	 // x87 control word
+	uint16_t fs_fsw;	 // x87 status word
+	uint8_t fs_ftw;		 // x87 tag word (abridged)
+	uint8_t fs_reserved;
+	uint16_t fs_fop;	 // Last x87 opcode
+	uint32_t fs_fip;	 // Last x87 instruction pointer
+	uint32_t fs_fcs;
+	uint32_t fs_fdp;	 // Last x87 operand pointer
+	uint32_t fs_fds;
+	uint32_t fs_mxcsr;	 // SSE control and status
+	uint32_t fs_mxcsr_mask;
+	uint8_t fs_regs[480];	 // ST0-7/MM0-7, XMM0-7, reserved
+} __attribute__((aligned(16)));
+
+struct Vma;
+
 struct Env {
 	struct Trapframe env_tf; // Saved registers
 	struct Env *env_link;	 // Next free Env
@@ -47,24 +75,37 @@ struct Env {
 	enum EnvType env_type;	 // Indicates special system environments
 	unsigned env_status;	 // Status of the environment
 	uint32_t env_runs;	 // Number of times environment has run
-	int env_cpunum;		 // The CPU that the env is running on
+	int env_cpunum;		 // The CPU that has the env loaded, or -1
+	struct Env *env_rq_link; // Next env on a CPU run queue
+	volatile uint32_t env_rq_queued; // Linked on a run queue
+	uint32_t env_quantum;	 // Time slice in timer ticks, 0 for default
+	uint32_t env_slice;	 // Microseconds used of the current time slice
+	enum EnvSchedClass env_sched_class; // Scheduling class
+	int env_priority;	 // ENV_PRIO_MIN..ENV_PRIO_MAX, 0 by default
+	uint64_t env_vruntime;	 // Weighted run time, for ENV_SCHED_FAIR
 
 	// Address space
 	pde_t *env_pgdir; // Kernel virtual address of page dir
+	struct Vma *env_vmas; // Regions that may be mapped (kern/vma.c)
 
 	// Exception handling
 	void *env_pgfault_upcall; // Page fault upcall entry point
 
 	// Lab 4 IPC
 	bool env_ipc_recving;	// Env is blocked receiving
-	void *env_ipc_dstva;	// VA at which to map received page
+	void *env_ipc_dstva;	// VA at which to map received pages
+	size_t env_ipc_npages;	// Pages wanted at dstva, then pages received
 	uint32_t env_ipc_value; // Data value sent to us
 	envid_t env_ipc_from;	// envid of the sender
-	int env_ipc_perm;	// Perm of page mapping received
+	int env_ipc_perm;	// Perm of page mappings received
 
 	//
 	bool env_net_recving;
 	void *env_net_recv_packet;
+
+	// FPU and SSE state, switched lazily (see kern/fpu.c)
+	int env_fpu_cpu;	 // CPU whose registers hold it, or -1
+	struct FpuState env_fpu; // Saved state
 };
 
 #endif // !JOS_INC_ENV_H
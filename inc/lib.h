@@ -22,6 +22,8 @@
 #include <inc/args.h>
 #include <inc/malloc.h>
 #include <inc/ns.h>
+#include <inc/time.h>
+#include <inc/shm.h>
 
 #define USED(x) (void)(x)
 
@@ -38,6 +40,7 @@ extern const volatile struct Env *thisenv;
 #endif
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
+extern const volatile struct TimePage timepage;
 
 // exit.c
 void exit(void);
@@ -55,6 +58,7 @@ envid_t sys_getenvid(void);
 int sys_env_destroy(envid_t);
 void sys_yield(void);
 static envid_t sys_exofork(void);
+envid_t sys_fork(void);
 int sys_env_set_status(envid_t env, int status);
 int sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int sys_env_set_pgfault_upcall(envid_t env, void *upcall);
@@ -62,12 +66,23 @@ int sys_page_alloc(envid_t env, void *pg, int perm);
 int sys_page_map(envid_t src_env, void *src_pg, envid_t dst_env, void *dst_pg,
 		 int perm);
 int sys_page_unmap(envid_t env, void *pg);
+int sys_mmap(envid_t env, void *va, size_t len, int perm);
+int sys_shm_create(const char *name, size_t len);
+int sys_shm_attach(envid_t env, const char *name, void *va, int perm);
+int sys_shm_detach(envid_t env, void *va, size_t len);
+int sys_shm_unlink(const char *name);
 int sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int sys_ipc_recv(void *rcv_pg);
+int sys_ipc_try_send_range(envid_t to_env, uint32_t value, void *pg,
+			   size_t npages, int perm);
+int sys_ipc_recv_range(void *rcv_pg, size_t npages);
 int sys_exec(envid_t envid); // lab 5 challenge
 unsigned int sys_time_msec(void);
 int sys_packet_transmit(const void *packet, int len);
 int sys_packet_receive(void* packets);
+int sys_env_set_quantum(envid_t env, uint32_t ticks);
+int sys_env_set_priority(envid_t env, int priority);
+int sys_multicall(struct Multicall *calls, int n);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t __attribute__((always_inline)) sys_exofork(void)
@@ -79,13 +94,27 @@ static __inline envid_t __attribute__((always_inline)) sys_exofork(void)
 	return ret;
 }
 
+// multicall.c
+struct McBatch {
+	struct Multicall mb_calls[MULTICALL_MAX];
+	int mb_n;
+};
+void mc_init(struct McBatch *b);
+int mc_add(struct McBatch *b, uint32_t num, uint32_t a1, uint32_t a2,
+	   uint32_t a3, uint32_t a4, uint32_t a5);
+int mc_reserve(struct McBatch *b, int n);
+int mc_flush(struct McBatch *b);
+
 // ipc.c
 void ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+void ipc_send_range(envid_t to_env, uint32_t value, void *pg, size_t npages,
+		    int perm);
+int32_t ipc_recv_range(envid_t *from_env_store, void *pg, size_t npages,
+		       int *perm_store, size_t *npages_store);
 envid_t ipc_find_env(enum EnvType type);
 
 // fork.c
-#define PTE_SHARE 0x400
 envid_t fork(void);
 envid_t sfork(void); // Challenge!
 
@@ -109,6 +138,10 @@ int sync(void);
 // pageref.c
 int pageref(void *addr);
 
+// time.c
+uint64_t time_nsec(void);
+unsigned int time_msec(void);
+
 // sockets.c
 int accept(int s, struct sockaddr *addr, socklen_t *addrlen);
 int bind(int s, struct sockaddr *name, socklen_t namelen);
@@ -17,6 +17,7 @@
 #define GD_UT     0x18     // user text
 #define GD_UD     0x20     // user data
 #define GD_TSS0   0x28     // Task segment selector for CPU 0
+#define GD_CPU0   0x68     // Per-CPU data selector for CPU 0 (GD_TSS0 + NCPU*8)
 
 /*
  * Virtual memory map:                                Permissions
@@ -50,7 +51,9 @@
  *    UVPT      ---->  +------------------------------+ 0xef400000
  *                     |          RO PAGES            | R-/R-  PTSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
- *                     |           RO ENVS            | R-/R-  PTSIZE
+ *                     |           RO TIME            | R-/R-  PGSIZE
+ *    UTIME     ---->  +------------------------------+ 0xeefff000
+ *                     |           RO ENVS            | R-/R-  PTSIZE-PGSIZE
  * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
  *                     +------------------------------+ 0xeebff000
@@ -114,6 +117,9 @@
 #define UPAGES		(UVPT - PTSIZE)
 // Read-only copies of the global env structures
 #define UENVS		(UPAGES - PTSIZE)
+// Read-only time page (see inc/time.h), in the last page of the
+// UENVS region
+#define UTIME		(UPAGES - PGSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -176,8 +182,10 @@ extern volatile pde_t uvpd[];     // VA of current page directory
  * with page2pa() in kern/pmap.h.
  */
 struct PageInfo {
-	// Next page on the free list.
+	// Next and previous free block of the same order on the free
+	// lists, which link only the first page of each free block.
 	struct PageInfo *pp_link;
+	struct PageInfo *pp_prev;
 
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
@@ -185,6 +193,14 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Log2 of the number of pages in the block this page starts,
+	// if it was allocated (or is free) as a whole; otherwise 0.
+	// A block of SP_ORDER pages is mapped as a superpage.
+	uint16_t pp_order;
+
+	// Whether this page starts a block on the free lists.
+	uint16_t pp_free;
 };
 
 #endif /* !__ASSEMBLER__ */
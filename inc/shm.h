@@ -0,0 +1,11 @@
+#ifndef JOS_INC_SHM_H
+#define JOS_INC_SHM_H
+
+// Named shared-memory segments (sys_shm_create and friends).
+
+// Longest segment name, including the terminating '\0'
+#define SHM_NAMELEN 32
+// Largest segment
+#define SHM_MAXSIZE (64 * 1024 * 1024)
+
+#endif	// !JOS_INC_SHM_H
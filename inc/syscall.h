@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -10,18 +12,39 @@ enum {
 	SYS_page_alloc,
 	SYS_page_map,
 	SYS_page_unmap,
+	SYS_mmap,
+	SYS_shm_create,
+	SYS_shm_attach,
+	SYS_shm_detach,
+	SYS_shm_unlink,
 	SYS_exofork,
+	SYS_fork,
 	SYS_env_set_status,
 	SYS_env_set_trapframe,
 	SYS_env_set_pgfault_upcall,
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_ipc_try_send_range,
+	SYS_ipc_recv_range,
 	SYS_exec,
 	SYS_time_msec,
 	SYS_packet_transmit,
 	SYS_packet_receive,
+	SYS_env_set_quantum,
+	SYS_env_set_priority,
+	SYS_multicall,
 	NSYSCALLS
 };
 
+// One system call in a sys_multicall batch.
+struct Multicall {
+	uint32_t mc_num;	// System call number
+	uint32_t mc_args[5];
+	int32_t mc_result;	// Return value, filled in by the kernel
+};
+
+// Most calls sys_multicall takes at once
+#define MULTICALL_MAX 32
+
 #endif /* !JOS_INC_SYSCALL_H */
@@ -0,0 +1,33 @@
+#ifndef JOS_INC_TIME_H
+#define JOS_INC_TIME_H
+
+#include <inc/types.h>
+
+// The time page, mapped read-only into every environment at UTIME.
+// The kernel fills it in once at boot; afterwards anyone can turn a
+// TSC reading into nanoseconds since boot without a system call:
+//
+//	ns = tp_nsec + tsc_to_nsec(read_tsc() - tp_tsc, tp_mult)
+//
+// This assumes that the TSCs of all CPUs tick at one constant rate
+// and were reset together, as on processors with an invariant TSC.
+struct TimePage {
+	uint64_t tp_tsc;	// TSC at the time origin
+	uint64_t tp_nsec;	// Nanoseconds since boot at tp_tsc
+	uint64_t tp_mult;	// Nanoseconds per TSC cycle, 32.32 fixed point
+	uint32_t tp_tsc_khz;	// TSC frequency, for reference
+};
+
+// Return (cycles * mult) >> 32 without overflowing, for
+// cycles < 2^64 and results < 2^64.
+static __inline uint64_t
+tsc_to_nsec(uint64_t cycles, uint64_t mult)
+{
+	uint32_t cl = cycles, ch = cycles >> 32;
+	uint32_t ml = mult, mh = mult >> 32;
+
+	return (((uint64_t)cl * ml) >> 32) + (uint64_t)cl * mh +
+	       (uint64_t)ch * ml + (((uint64_t)ch * mh) << 32);
+}
+
+#endif /* !JOS_INC_TIME_H */
@@ -228,6 +228,25 @@ rcr4(void)
 	return cr4;
 }
 
+static __inline void
+clts(void)
+{
+	__asm __volatile("clts");
+}
+
+// 'area' must be 512 bytes, 16-byte aligned.
+static __inline void
+fxsave(void *area)
+{
+	__asm __volatile("fxsave %0" : "=m"(*(char (*)[512])area));
+}
+
+static __inline void
+fxrstor(const void *area)
+{
+	__asm __volatile("fxrstor %0" : : "m"(*(const char (*)[512])area));
+}
+
 static __inline void
 tlbflush(void)
 {
@@ -314,6 +333,31 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically add 'inc' to *addr and return the old value.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t inc)
+{
+	asm volatile("lock; xaddl %0, %1"
+		     : "+r"(inc), "+m"(*addr)
+		     :
+		     : "cc");
+	return inc;
+}
+
+// Atomically set *addr to 'newval' if it equals 'oldval'.
+// Returns the value *addr had before.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %1"
+		     : "=a"(result), "+m"(*addr)
+		     : "r"(newval), "0"(oldval)
+		     : "cc");
+	return result;
+}
+
 static inline bool
 page_size_extension()
 {
@@ -322,4 +366,62 @@ page_size_extension()
 	return (d & (1 << 3));
 }
 
+static inline bool
+page_global_enable()
+{
+	uint32_t a = 0, b = 0, c = 0, d = 0;
+	cpuid(1, &a, &b, &c, &d);
+	return (d & (1 << 13));
+}
+
+static inline bool
+sse2_supported()
+{
+	uint32_t a = 0, b = 0, c = 0, d = 0;
+	cpuid(1, &a, &b, &c, &d);
+	return (d & (1 << 26));
+}
+
+// Zero 'cnt' dwords at 'addr' (a multiple of 4, 16-byte aligned) with
+// non-temporal stores, which bypass the cache.  Needs SSE2.
+static inline void
+movnti_zero(void *addr, int cnt)
+{
+	asm volatile("1:\n\t"
+		     "movnti %2, (%0)\n\t"
+		     "movnti %2, 4(%0)\n\t"
+		     "movnti %2, 8(%0)\n\t"
+		     "movnti %2, 12(%0)\n\t"
+		     "addl $16, %0\n\t"
+		     "subl $4, %1\n\t"
+		     "jnz 1b\n\t"
+		     "sfence"
+		     : "+r"(addr), "+r"(cnt)
+		     : "r"(0)
+		     : "memory", "cc");
+}
+
+// Model-specific registers for sysenter
+#define MSR_SYSENTER_CS		0x174
+#define MSR_SYSENTER_ESP	0x175
+#define MSR_SYSENTER_EIP	0x176
+
+static inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c"(msr), "A"(val));
+}
+
+// Does the CPU have sysenter and sysexit?  The earliest Pentium Pros
+// claim to but do not.
+static inline bool
+sysenter_supported()
+{
+	uint32_t a = 0, b = 0, c = 0, d = 0;
+	cpuid(1, &a, &b, &c, &d);
+	if (((a >> 8) & 0xF) == 6 && ((a >> 4) & 0xF) < 3 && (a & 0xF) < 3)
+		return false;
+	return (d & (1 << 11));
+}
+
 #endif /* !JOS_INC_X86_H */
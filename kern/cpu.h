@@ -19,9 +19,11 @@ enum {
 
 // Per-CPU state
 struct CpuInfo {
+	struct CpuInfo *cpu_self;       // This struct, read through %gs by thiscpu
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
+	struct Env *cpu_fpu_env;        // Env whose state the FPU holds, if any
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
 };
 
@@ -35,12 +37,34 @@ extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
 extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
 
 int cpunum(void);
-#define thiscpu (&cpus[cpunum()])
+
+// Once env_init_percpu has run, each CPU's GS selects a segment based
+// at its own struct CpuInfo, so finding it takes one GS-relative load
+// instead of an MMIO read of the LAPIC ID.  Before that, and while
+// GS holds a user selector on the way out to user mode, fall back on
+// the LAPIC.
+static inline struct CpuInfo *
+cpu_this(void)
+{
+	struct CpuInfo *c;
+	uint16_t gs;
+
+	asm volatile("movw %%gs,%0" : "=r"(gs));
+	if (gs < GD_CPU0)
+		return &cpus[cpunum()];
+	asm volatile("movl %%gs:0,%0" : "=r"(c));
+	return c;
+}
+#define thiscpu (cpu_this())
 
 void mp_init(void);
 void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int apicid, int vector);
+void lapic_timer_oneshot(uint32_t us);
+void lapic_timer_stop(void);
+uint32_t lapic_timer_elapsed(void);
 
 #endif
@@ -2,6 +2,8 @@
 #include <kern/pci.h>
 #include <kern/pmap.h>
 #include <kern/env.h>
+#include <kern/spinlock.h>
+#include <kern/vma.h>
 #include <inc/env.h>
 #include <inc/stdio.h>
 #include <inc/string.h>
@@ -16,6 +18,13 @@ static struct PageInfo *rx_packets[RX_QUEUE_SZ];
 static struct PageInfo *packet_fifo[PACKET_FIFO_SZ], **packet_fifo_head, **packet_fifo_tail;
 static uint32_t packet_fifo_count = 0;
 
+// Guards the tx/rx rings and the packet fifo.
+static struct spinlock e1000_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "e1000_lock"
+#endif
+};
+
 static struct tx_desc {
 	uint64_t addr;
 	uint16_t length;
@@ -122,6 +131,7 @@ e1000_packet_transmit(const uint8_t packet[], int len)
 {
 	assert(len < MAX_PACKET_LEN);
 
+	spin_lock(&e1000_lock);
 	volatile struct tx_desc *tail = &tx_queue[bar0[E1000_TDT]];
 	while (!(tail->status & E1000_TXD_STAT_DD)) // TODO
 		;
@@ -141,12 +151,14 @@ e1000_packet_transmit(const uint8_t packet[], int len)
 
 	// Zero-copy challenge!
 	// TODO: make the user page entry as copy on write until the page is transmitted
-	struct PageInfo *pg = page_lookup(curenv->env_pgdir, (void *)packet, 0);
-	tail->addr = page2pa(pg) + PGOFF(packet);
+	pte_t *pte;
+	page_lookup(curenv->env_pgdir, (void *)packet, &pte);
+	tail->addr = pte2pa(*pte, packet);
 	tail->length = len;
 
 	// commit by update tx tail
 	bar0_reg32(E1000_TDT) = (bar0_reg32(E1000_TDT) + 1) % TX_QUEUE_SZ;
+	spin_unlock(&e1000_lock);
 
 	return 0;
 }
@@ -155,6 +167,8 @@ int
 e1000_packet_receive()
 {
 	struct PageInfo *new_page;
+
+	spin_lock(&e1000_lock);
 	uint32_t icr = bar0_reg32(E1000_ICR);
 	uint32_t ims = bar0_reg32(E1000_IMS);
 	volatile uint32_t *rdh = &bar0_reg32(E1000_RDH);
@@ -163,6 +177,7 @@ e1000_packet_receive()
 	volatile struct rx_desc *tail_next = &rx_queue[tail_next_off];
 
 	if (!(tail_next->status & E1000_TXD_STAT_DD) || (tail_next_off == *rdh)) {
+		spin_unlock(&e1000_lock);
 		if (icr & ims) 
 			return E1000_RECV_QUEUE_EMPTY;
 		return E1000_RECV_UNREQUESTED_INTERRUPT;
@@ -192,21 +207,26 @@ e1000_packet_receive()
 		tail_next_off = (tail_next_off + 1) % RX_QUEUE_SZ;
 		tail_next = &rx_queue[tail_next_off];
 	} while ((tail_next->status & E1000_TXD_STAT_DD) && (tail_next_off != *rdh));
+	spin_unlock(&e1000_lock);
 
 	return E1000_RECV_SUCCESS;
 }
 
 int
-packet_receive(pde_t *pgdir, void *packet)
+packet_receive(struct Env *e, void *packet)
 {
-	// copy data
-	if (packet_fifo_count == 0)
+	// The caller holds e's lock.
+	spin_lock(&e1000_lock);
+	if (packet_fifo_count == 0) {
+		spin_unlock(&e1000_lock);
 		return E1000_RECV_QUEUE_EMPTY;
-	if (page_insert(pgdir, *packet_fifo_tail, packet, PTE_U | PTE_W) < 0)
+	}
+	if (vma_page_insert(e, *packet_fifo_tail, packet, PTE_U | PTE_W) < 0)
 		panic("page_insert");
 
 	packet_fifo_count--;
 	packet_fifo_tail = packet_fifo_tail == &packet_fifo[PACKET_FIFO_SZ] ? packet_fifo : packet_fifo_tail + 1;
+	spin_unlock(&e1000_lock);
 
 	return E1000_RECV_SUCCESS;
 }
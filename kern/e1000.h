@@ -115,6 +115,6 @@ struct e1000_packet_receive_res {
 typedef uint8_t (*rx_packets_t)[MAX_PACKET_LEN];
 
 int e1000_packet_receive();
-int packet_receive(pde_t *pgdir, void *packet);
+int packet_receive(struct Env *e, void *packet);
 
 #endif // JOS_KERN_E1000_H
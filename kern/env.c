@@ -17,11 +17,23 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/fpu.h>
+#include <kern/vma.h>
 
 struct Env *envs = NULL;	  // All environments
 static struct Env *env_free_list; // Free environment list
 				  // (linked by Env->env_link)
 
+// Guards env_free_list and the allocation of env ids.
+static struct spinlock env_table_lock;
+
+// Per-env locks, indexed like envs[].  An env's lock guards its
+// status, its IPC fields, its trap frame when modified by another env,
+// and its address space (env_pgdir and the page tables below it).
+// Order: env lock, then env_table_lock, then the page allocator.
+// Two env locks are taken in envs[] index order (env_lock_pair).
+static struct spinlock env_locks[NENV];
+
 #define ENVGENSHIFT 12 // >= LOGNENV
 
 // Global descriptor table.
@@ -39,7 +51,7 @@ static struct Env *env_free_list; // Free environment list
 // definition of gdt specifies the Descriptor Privilege Level (DPL)
 // of that descriptor: 0 for kernel and 3 for user.
 //
-struct Segdesc gdt[NCPU + 5] = {
+struct Segdesc gdt[2 * NCPU + 5] = {
 	// 0x0 - unused (always faults -- for trapping NULL far pointers)
 	SEG_NULL,
 
@@ -57,7 +69,11 @@ struct Segdesc gdt[NCPU + 5] = {
 
 	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
 	// in trap_init_percpu()
-	[GD_TSS0 >> 3] = SEG_NULL
+	[GD_TSS0 >> 3] = SEG_NULL,
+
+	// Per-CPU data segments (starting from GD_CPU0) are initialized
+	// in env_init_percpu()
+	[GD_CPU0 >> 3] = SEG_NULL
 };
 
 struct Pseudodesc gdt_pd = { sizeof(gdt) - 1, (unsigned long)gdt };
@@ -108,6 +124,74 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+// Like envid2env, but returns with the env's lock held.  The checks
+// are redone under the lock, since the env may have been freed and
+// its slot reused after the unlocked lookup.
+int
+envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, checkperm)) < 0)
+		return r;
+	env_lock(e);
+	if (!env_is(e, envid) ||
+	    (checkperm && e != curenv && e->env_parent_id != curenv->env_id)) {
+		env_unlock(e);
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
+	*env_store = e;
+	return 0;
+}
+
+// Whether 'e' still is the env named by 'envid' (0 meaning curenv).
+// Callers should hold e's lock for the answer to stay true.
+bool
+env_is(struct Env *e, envid_t envid)
+{
+	if (envid == 0)
+		return e == curenv;
+	return e->env_status != ENV_FREE && e->env_id == envid;
+}
+
+void
+env_lock(struct Env *e)
+{
+	spin_lock(&env_locks[e - envs]);
+}
+
+void
+env_unlock(struct Env *e)
+{
+	spin_unlock(&env_locks[e - envs]);
+}
+
+// Lock two envs, which may be the same one, without risking a
+// deadlock against a CPU locking the same pair the other way round.
+void
+env_lock_pair(struct Env *a, struct Env *b)
+{
+	if (a == b) {
+		env_lock(a);
+	} else if (a < b) {
+		env_lock(a);
+		env_lock(b);
+	} else {
+		env_lock(b);
+		env_lock(a);
+	}
+}
+
+void
+env_unlock_pair(struct Env *a, struct Env *b)
+{
+	env_unlock(a);
+	if (a != b)
+		env_unlock(b);
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -120,9 +204,13 @@ env_init(void)
 	// Set up envs array
 	// LAB 3: Your code here.
 	int i;
+
+	spin_initlock_mcs(&env_table_lock);
 	for (i = NENV - 1; i >= 0; --i) {
+		__spin_initlock(&env_locks[i], "env_lock");
 		envs[i].env_status = ENV_FREE;
 		envs[i].env_id = 0;
+		envs[i].env_cpunum = -1;
 		envs[i].env_link = env_free_list;
 		env_free_list = &envs[i];
 	}
@@ -134,10 +222,18 @@ env_init(void)
 void
 env_init_percpu(void)
 {
+	int i = cpunum();
+
+	static_assert(GD_CPU0 == GD_TSS0 + (NCPU << 3));
+	cpus[i].cpu_self = &cpus[i];
+	gdt[(GD_CPU0 >> 3) + i] =
+	    SEG(STA_W, (uint32_t)&cpus[i], sizeof(struct CpuInfo) - 1, 0);
+
 	lgdt(&gdt_pd);
-	// The kernel never uses GS or FS, so we leave those set to
-	// the user data segment.
-	asm volatile("movw %%ax,%%gs" ::"a"(GD_UD | 3));
+	// The kernel reaches this CPU's struct CpuInfo through GS (see
+	// thiscpu).  It never uses FS, so we leave that set to the user
+	// data segment; env_pop_tf gives both to the user.
+	asm volatile("movw %%ax,%%gs" ::"a"(GD_CPU0 + (i << 3)));
 	asm volatile("movw %%ax,%%fs" ::"a"(GD_UD | 3));
 	// The kernel does use ES, DS, and SS.  We'll change between
 	// the kernel and user data segments as needed.
@@ -202,6 +298,8 @@ env_setup_vm(struct Env *e)
 //
 // Allocates and initializes a new environment.
 // On success, the new environment is stored in *newenv_store.
+// It starts out ENV_NOT_RUNNABLE, so that no other CPU can run it
+// before the caller has finished setting it up.
 //
 // Returns 0 on success, < 0 on failure.  Errors include:
 //	-E_NO_FREE_ENV if all NENVS environments are allocated
@@ -214,12 +312,17 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
+	spin_lock(&env_table_lock);
+	if (!(e = env_free_list)) {
+		spin_unlock(&env_table_lock);
 		return -E_NO_FREE_ENV;
+	}
 
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	if ((r = env_setup_vm(e)) < 0) {
+		spin_unlock(&env_table_lock);
 		return r;
+	}
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -230,8 +333,16 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
+	e->env_status = ENV_NOT_RUNNABLE;
 	e->env_runs = 0;
+	e->env_cpunum = -1;
+	e->env_quantum = 0;
+	e->env_slice = 0;
+	e->env_sched_class = ENV_SCHED_FAIR;
+	e->env_priority = 0;
+	e->env_vruntime = 0;
+	e->env_vmas = NULL;
+	fpu_env_init(e);
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -263,18 +374,155 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
+	e->env_ipc_npages = 0;
 
 	//
 	e->env_net_recving = 0;
 
 	// commit the allocation
 	env_free_list = e->env_link;
+	spin_unlock(&env_table_lock);
 	*newenv_store = e;
 
 	// cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 	return 0;
 }
 
+//
+// Allocates a new environment, stored in *child_store, that is a copy
+// of 'parent' as far as the CPU is concerned: same registers (except
+// that the system call returns 0 in the child), FPU state and
+// scheduling parameters.  Its address space is empty and it is
+// ENV_NOT_RUNNABLE.
+//
+// Returns 0 on success, < 0 on failure (see env_alloc).
+//
+int
+env_dup(struct Env **child_store, struct Env *parent)
+{
+	struct Env *child;
+	int r;
+
+	if ((r = env_alloc(&child, parent->env_id)) < 0)
+		return r;
+
+	child->env_quantum = parent->env_quantum;
+	child->env_sched_class = parent->env_sched_class;
+	child->env_priority = parent->env_priority;
+	child->env_vruntime = parent->env_vruntime;
+	child->env_tf = parent->env_tf;
+	child->env_tf.tf_regs.reg_eax = 0;
+	fpu_save(parent);
+	child->env_fpu = parent->env_fpu;
+	*child_store = child;
+	return 0;
+}
+
+//
+// Shares the page (or superpage) mapped by the parent's entry '*ppte'
+// for env_fork, making it PTE_COW first if it is writable and not
+// PTE_SHARE; '*flush' notes that the parent's TLB is stale.
+// Returns the child's entry.
+//
+static pte_t
+fork_pte(pte_t *ppte, bool *flush)
+{
+	pte_t pte = *ppte;
+
+	if ((pte & (PTE_W | PTE_COW)) && !(pte & PTE_SHARE)) {
+		pte = (pte & ~PTE_W) | PTE_COW;
+		*ppte = pte;
+		*flush = true;
+	}
+	page_incref(pa2page(PTE_ADDR(pte)));
+	return PTE_ADDR(pte) | (pte & (PTE_SYSCALL | PTE_PS));
+}
+
+//
+// Forks 'parent', which must be curenv, copy-on-write.  Every page
+// mapped below USTACKTOP is shared with the child: PTE_SHARE and
+// read-only pages as they are, writable ones as PTE_COW in both
+// address spaces; superpages likewise, PDE by PDE.  The child's page
+// tables are filled in directly,
+// and our TLB is flushed once at the end rather than per page.
+// The child also gets a fresh exception stack and our page fault
+// upcall, and is made runnable.
+//
+// Returns the child's envid, < 0 on failure.  Errors are:
+//	-E_NO_FREE_ENV if all NENVS environments are allocated
+//	-E_NO_MEM on memory exhaustion
+// Pages already marked PTE_COW in the parent stay so on failure.
+//
+envid_t
+env_fork(struct Env *parent)
+{
+	struct Env *child;
+	struct PageInfo *pp;
+	struct Vma *v;
+	pde_t *pde;
+	pte_t *ppt, *cpt;
+	uintptr_t va, end;
+	bool flush = false;
+	envid_t id;
+	int r;
+
+	assert(parent == curenv);
+	if ((r = env_dup(&child, parent)) < 0)
+		return r;
+
+	env_lock_pair(parent, child);
+	if (vma_dup(child, parent, USTACKTOP) < 0)
+		goto nomem;
+	for (v = parent->env_vmas; v && v->vm_start < USTACKTOP;
+	     v = v->vm_next) {
+		end = MIN(v->vm_end, USTACKTOP);
+		for (va = v->vm_start; va < end; va += PGSIZE) {
+			pde = &parent->env_pgdir[PDX(va)];
+			if (!(*pde & PTE_P) || (*pde & PTE_PS)) {
+				if ((*pde & PTE_PS) &&
+				    !(child->env_pgdir[PDX(va)] & PTE_P))
+					child->env_pgdir[PDX(va)] =
+						fork_pte(pde, &flush);
+				// On to the next page table.
+				va = ROUNDDOWN(va, PTSIZE) + PTSIZE - PGSIZE;
+				continue;
+			}
+			ppt = (pte_t *)KADDR(PTE_ADDR(*pde)) + PTX(va);
+			if (!(*ppt & PTE_P))
+				continue;
+			if (!(cpt = pgdir_walk(child->env_pgdir, (void *)va, 1)))
+				goto nomem;
+			*cpt = fork_pte(ppt, &flush);
+		}
+	}
+	if (flush)
+		lcr3(PADDR(parent->env_pgdir));
+	flush = false;
+
+	// The exception stack is never shared.
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		goto nomem;
+	if (vma_page_insert(child, pp, (void *)(UXSTACKTOP - PGSIZE),
+			    PTE_U | PTE_W) < 0) {
+		page_free(pp);
+		goto nomem;
+	}
+	child->env_pgfault_upcall = parent->env_pgfault_upcall;
+
+	id = child->env_id;
+	child->env_status = ENV_RUNNABLE;
+	sched_enqueue(child);
+	env_unlock_pair(parent, child);
+	return id;
+
+nomem:
+	if (flush)
+		lcr3(PADDR(parent->env_pgdir));
+	env_unlock(parent);
+	env_destroy(child);
+	return -E_NO_MEM;
+}
+
 //
 // Allocate len bytes of physical memory for environment env,
 // and map it at virtual address va in the environment's address space.
@@ -300,7 +548,7 @@ region_alloc(struct Env *e, void *va, size_t len)
 	     p += PGSIZE) {
 		if (!(pp = page_alloc(0)))
 			panic("env region_alloc no memory");
-		if (page_insert(e->env_pgdir, pp, p, PTE_W | PTE_U | PTE_P) < 0)
+		if (vma_page_insert(e, pp, p, PTE_W | PTE_U | PTE_P) < 0)
 			panic("env region_alloc no memory");
 	}
 }
@@ -404,54 +652,40 @@ env_create(uint8_t *binary, enum EnvType type)
 	env->env_type = type;
 	env->env_parent_id = 0;
 
+	// Device servers are latency-sensitive; keep them ahead of
+	// ordinary envs.  Envs they fork inherit the class.
+	if (type == ENV_TYPE_FS || type == ENV_TYPE_NS)
+		env->env_sched_class = ENV_SCHED_RT;
+
 	// If this is the file server (type == ENV_TYPE_FS) give it I/O privileges.
 	// LAB 5: Your code here.
 	if (type == ENV_TYPE_FS) {
 		env->env_tf.tf_eflags |= FL_IOPL_3;
 	}
+
+	env->env_status = ENV_RUNNABLE;
+	sched_enqueue(env);
 }
 
 //
 // Frees env e and all memory it uses.
+// The caller holds e's lock, and no CPU may still have e loaded
+// (e->env_cpunum < 0).
 //
 void
 env_free(struct Env *e)
 {
-	pte_t *pt;
-	uint32_t pdeno, pteno;
 	physaddr_t pa;
 
-	// If freeing the current environment, switch to kern_pgdir
-	// before freeing the page directory, just in case the page
-	// gets reused.
-	if (e == curenv)
-		lcr3(PADDR(kern_pgdir));
+	assert(e->env_cpunum < 0);
 
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-	// Flush all mapped pages in the user portion of the address space
-	static_assert(UTOP % PTSIZE == 0);
-	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
-		// only look at mapped page tables
-		if (!(e->env_pgdir[pdeno] & PTE_P))
-			continue;
-
-		// find the pa and va of the page table
-		pa = PTE_ADDR(e->env_pgdir[pdeno]);
-		pt = (pte_t *)KADDR(pa);
-
-		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
-			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir,
-					    PGADDR(pdeno, pteno, 0));
-		}
-
-		// free the page table itself
-		e->env_pgdir[pdeno] = 0;
-		page_decref(pa2page(pa));
-	}
+	// Flush all mapped pages in the user portion of the address space,
+	// and the page tables (or superpages) mapping them
+	vma_unmap(e, 0, UTOP);
+	assert(!e->env_vmas);
 
 	// free the page directory
 	pa = PADDR(e->env_pgdir);
@@ -459,33 +693,51 @@ env_free(struct Env *e)
 	page_decref(pa2page(pa));
 
 	// return the environment to the free list
+	spin_lock(&env_table_lock);
 	e->env_status = ENV_FREE;
 	e->env_link = env_free_list;
 	env_free_list = e;
+	spin_unlock(&env_table_lock);
 }
 
 //
-// Frees environment e.
+// Frees environment e.  The caller holds e's lock; env_destroy
+// releases it.
 // If e was the current env, then runs a new environment (and does not return
 // to the caller).
 //
 void
 env_destroy(struct Env *e)
 {
-	// If e is currently running on other CPUs, we change its state to
-	// ENV_DYING. A zombie environment will be freed the next time
-	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
+	bool self = (e == curenv);
+
+	if (e->env_status != ENV_DYING) {
 		e->env_status = ENV_DYING;
-		return;
+		// If some CPU still has e loaded (it may be running it
+		// right now), leave e a zombie.  That CPU frees it when
+		// it switches away, at the latest on e's next trap.
+		if (e->env_cpunum < 0)
+			env_free(e);
 	}
+	env_unlock(e);
 
-	env_free(e);
-
-	if (curenv == e) {
-		curenv = NULL;
+	if (self)
 		sched_yield();
-	}
+}
+
+// Called once this CPU has switched away from 'e' (it is no longer
+// curenv and no longer in cr3).  Its FPU registers are saved first;
+// then another CPU may run e, or free it if it was destroyed
+// meanwhile.
+void
+env_release(struct Env *e)
+{
+	fpu_save(e);
+	env_lock(e);
+	e->env_cpunum = -1;
+	if (e->env_status == ENV_DYING)
+		env_free(e);
+	env_unlock(e);
 }
 
 //
@@ -497,9 +749,10 @@ env_destroy(struct Env *e)
 void
 env_pop_tf(struct Trapframe *tf)
 {
-	// Record the CPU we are running on for user-space debugging
-	curenv->env_cpunum = cpunum();
-
+	// The trap frame has no GS or FS; user code always gets the
+	// user data segment in both.  From here on thiscpu is slow.
+	asm volatile("movw %%ax,%%gs\n"
+		     "\tmovw %%ax,%%fs" ::"a"(GD_UD | 3));
 	__asm __volatile(
 		"movl %0,%%esp\n"
 		"\tpopal\n"
@@ -540,45 +793,66 @@ env_run(struct Env *e)
 	//	e->env_tf to sensible values.
 
 	// LAB 3: Your code here.
-	if (curenv && curenv->env_status == ENV_RUNNING)
-		curenv->env_status = ENV_RUNNABLE;
+
+	// The caller holds e's lock, and e is ENV_RUNNABLE and not loaded
+	// on another CPU (or is already curenv).  The previous env is
+	// handed back only after cr3 no longer points into its page
+	// directory, so that it cannot be freed under our feet.
+	struct Env *prev = curenv;
 
 	e->env_status = ENV_RUNNING;
-	e->env_runs++;
-	lcr3(PADDR(e->env_pgdir));
-	curenv = e;
-	unlock_kernel();
+	e->env_cpunum = thiscpu->cpu_id;
+	if (prev != e) {
+		e->env_runs++;
+		lcr3(PADDR(e->env_pgdir));
+		curenv = e;
+	}
+	env_unlock(e);
+	if (prev != e) {
+		if (prev)
+			env_release(prev);
+		fpu_switch(e);
+	}
 	env_pop_tf(&e->env_tf);
 }
 
 int
 env_exec(struct Env *parent, struct Env *child)
 {
-	int r, pn;
-	uintptr_t addr;
+	int r;
+	uintptr_t addr, end;
 	struct PageInfo *page;
+	struct Vma *v;
 	pte_t *pte;
 
-	for (addr = 0; addr < USTACKTOP; addr += PGSIZE) {
-		if ((page = page_lookup(parent->env_pgdir, (void *)addr,
-					&pte)) &&
-		    (*pte & PTE_P)) {
-			page_remove(parent->env_pgdir, (void *)addr);
-		}
-
-		if ((page = page_lookup(child->env_pgdir, (void *)addr,
-					&pte)) &&
-		    (*pte & PTE_P)) {
-			if ((r = page_insert(parent->env_pgdir, page,
-					     (void *)addr,
-					     PTE_P | PTE_W | PTE_U)) < 0)
+	// The caller holds the locks of both parent and child;
+	// they are released before returning.
+	// Drop the parent's image, then move the child's pages over.
+	// The child keeps its references until env_destroy drops them.
+	vma_unmap(parent, 0, USTACKTOP);
+	for (v = child->env_vmas; v && v->vm_start < USTACKTOP;
+	     v = v->vm_next) {
+		end = MIN(v->vm_end, USTACKTOP);
+		for (addr = v->vm_start; addr < end; addr += PGSIZE) {
+			if (!(page = page_lookup(child->env_pgdir, (void *)addr,
+						 &pte)) ||
+			    !(*pte & PTE_P))
+				continue;
+			if (*pte & PTE_PS)
+				addr = ROUNDDOWN(addr, PTSIZE);
+			if ((r = vma_page_insert(parent, page, (void *)addr,
+						 PTE_P | PTE_W | PTE_U)) < 0) {
+				env_unlock_pair(parent, child);
 				return r;
-			page_remove(child->env_pgdir, (void *)addr);
+			}
+			if (*pte & PTE_PS)
+				addr += PTSIZE - PGSIZE;
 		}
 	}
 
 	parent->env_tf = child->env_tf;
 
+	env_unlock(parent);
 	env_destroy(child);
 	return 0;
 }
@@ -13,12 +13,21 @@ extern struct Segdesc gdt[];
 void env_init(void);
 void env_init_percpu(void);
 int env_alloc(struct Env **e, envid_t parent_id);
+int env_dup(struct Env **child_store, struct Env *parent);
+envid_t env_fork(struct Env *parent);
 void env_free(struct Env *e);
 void env_create(uint8_t *binary, enum EnvType type);
 void env_destroy(struct Env *e); // Does not return if e == curenv
+void env_release(struct Env *e);
 int env_exec(struct Env *parent, struct Env *child);
 
 int envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+int envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm);
+bool env_is(struct Env *e, envid_t envid);
+void env_lock(struct Env *e);
+void env_unlock(struct Env *e);
+void env_lock_pair(struct Env *a, struct Env *b);
+void env_unlock_pair(struct Env *a, struct Env *b);
 // The following two functions do not return
 void env_run(struct Env *e) __attribute__((noreturn));
 void env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
@@ -0,0 +1,83 @@
+// Lazy FPU and SSE context switching.
+//
+// An env's x87/MMX/SSE registers are loaded only when it first uses
+// them after being switched in.  fpu_switch sets CR0.TS, so the first
+// FPU or SSE instruction raises T_DEVICE (#NM), and fpu_trap loads
+// the env's state, unless this CPU's registers still hold it from the
+// last time.  An env that used the FPU has its registers saved when
+// it is switched out, so that another CPU can pick it up.  Envs that
+// never touch the FPU pay only for setting TS.
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/env.h>
+#include <inc/assert.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/fpu.h>
+
+// The state an env starts with: what FNINIT and a processor reset
+// leave, with all exceptions masked and every register zero.
+static const struct FpuState fpu_initial = {
+	.fs_fcw = 0x037F,
+	.fs_mxcsr = 0x1F80,
+};
+
+// Enable FXSAVE and SSE on this CPU, and arrange for the first FPU
+// instruction to trap.
+void
+fpu_init_percpu(void)
+{
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (!(edx & (1 << 24)))
+		panic("fpu: CPU has no FXSAVE");
+	lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+	lcr0((rcr0() & ~CR0_EM) | CR0_MP | CR0_NE | CR0_TS);
+	thiscpu->cpu_fpu_env = NULL;
+}
+
+// Give a new env clean FPU state.
+void
+fpu_env_init(struct Env *e)
+{
+	e->env_fpu_cpu = -1;
+	e->env_fpu = fpu_initial;
+}
+
+// Called when env_run switches this CPU to 'e'.  If the registers
+// still hold e's state, let it use them at once; otherwise trap on
+// first use.
+void
+fpu_switch(struct Env *e)
+{
+	if (thiscpu->cpu_fpu_env == e && e->env_fpu_cpu == thiscpu->cpu_id)
+		clts();
+	else
+		lcr0(rcr0() | CR0_TS);
+}
+
+// Save e's registers to e->env_fpu if they are live on this CPU and
+// may have changed since they were loaded.  e must be loaded on this
+// CPU (curenv, or the env being switched away from).
+void
+fpu_save(struct Env *e)
+{
+	if (thiscpu->cpu_fpu_env == e && !(rcr0() & CR0_TS))
+		fxsave(&e->env_fpu);
+}
+
+// #NM: curenv used the FPU with CR0.TS set.
+void
+fpu_trap(void)
+{
+	struct Env *e = curenv;
+
+	clts();
+	if (thiscpu->cpu_fpu_env == e && e->env_fpu_cpu == thiscpu->cpu_id)
+		return;
+	fxrstor(&e->env_fpu);
+	thiscpu->cpu_fpu_env = e;
+	e->env_fpu_cpu = thiscpu->cpu_id;
+}
@@ -0,0 +1,15 @@
+#ifndef JOS_KERN_FPU_H
+#define JOS_KERN_FPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+struct Env;
+
+void fpu_init_percpu(void);
+void fpu_env_init(struct Env *e);
+void fpu_switch(struct Env *e);
+void fpu_save(struct Env *e);
+void fpu_trap(void);
+
+#endif	// !JOS_KERN_FPU_H
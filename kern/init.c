@@ -7,6 +7,8 @@
 #include <kern/monitor.h>
 #include <kern/console.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
+#include <kern/vma.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/trap.h>
@@ -35,9 +37,12 @@ i386_init(void)
 
 	// Lab 2 memory management initialization functions
 	mem_init();
+	kmalloc_init();
+	vma_init();
 
 	// Lab 3 user environment initialization functions
 	env_init();
+	sched_init();
 	trap_init();
 
 	// Lab 4 multiprocessor initialization functions
@@ -51,13 +56,6 @@ i386_init(void)
 	time_init();
 	pci_init();
 
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-	lock_kernel();
-
-	// Starting non-boot CPUs
-	boot_aps();
-
 	// Start fs.
 	ENV_CREATE(fs_fs, ENV_TYPE_FS);
 
@@ -77,9 +75,13 @@ i386_init(void)
 	// Should not be necessary - drains keyboard because interrupt has given up.
 	kbd_intr();
 
+	// Starting non-boot CPUs.  Do this only now that there are
+	// environments for them to run, or the first one to find the
+	// run queues empty would drop into the monitor.
+	boot_aps();
+
 	// Schedule and run the first user environment!
 	sched_yield();
-	unlock_kernel();
 }
 
 // While boot_aps is booting a given CPU, it communicates the per-core
@@ -119,6 +121,11 @@ void
 mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir
+	// (which may map memory with 4MB and global pages).
+	if (pse_enabled)
+		lcr4(rcr4() | CR4_PSE);
+	if (pge_enabled)
+		lcr4(rcr4() | CR4_PGE);
 	lcr3(PADDR(kern_pgdir));
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
@@ -128,11 +135,7 @@ mp_main(void)
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
-	// to start running processes on this CPU.  But make sure that
-	// only one CPU can enter the scheduler at a time!
-	//
-	// Your code here:
-	lock_kernel();
+	// to start running processes on this CPU.
 	sched_yield();
 }
 
@@ -140,7 +140,7 @@ debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
 		// Make sure this memory is valid.
 		// Return -1 if it is not.  Hint: Call user_mem_check.
 		// LAB 3: Your code here.
-		if (user_mem_check(curenv, usd, sizeof(*usd), PTE_W) < 0)
+		if (user_mem_check(curenv, usd, sizeof(*usd), PTE_U) < 0)
 			return -1;
 
 		stabs = usd->stabs; //
@@ -150,10 +150,10 @@ debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
 
 		// Make sure the STABS and string table memory is valid.
 		// LAB 3: Your code here.
-		if (user_mem_check(curenv, stabs, stab_end - stabs, PTE_W) < 0)
+		if (user_mem_check(curenv, stabs, stab_end - stabs, PTE_U) < 0)
 			return -1;
 		if (user_mem_check(curenv, stabstr, stabstr_end - stabstr,
-				   PTE_W) < 0)
+				   PTE_U) < 0)
 			return -1;
 	}
 
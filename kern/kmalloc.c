@@ -0,0 +1,293 @@
+// Slab allocator for small kernel objects.
+//
+// Each KmemCache hands out objects of one size.  They are carved out of
+// one-page slabs; a slab starts with a struct Slab, which links the
+// slab onto its cache's list of slabs with free objects and keeps its
+// free objects on a list of indices, so a free object's contents are
+// left alone (see kc_ctor).  Each CPU keeps up to KMEM_CPU_MAX objects
+// of each cache to itself and moves KMEM_BATCH at a time from or to
+// the slabs, so most allocations take no lock.  kmalloc picks one of a
+// set of caches by size.
+//
+// Lock order: kc_lock, then page_lock.
+
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/stdio.h>
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
+
+#define SLAB_NONE 0xFFFF
+
+struct Slab {
+	struct Slab *s_next;	// On kc_partial
+	struct Slab *s_prev;
+	struct KmemCache *s_cache;
+	uint16_t s_inuse;	// Objects allocated
+	uint16_t s_free;	// First free object, or SLAB_NONE
+	uint16_t s_link[];	// The free object after each free one
+};
+
+#define KMALLOC_NCACHES 8 // 16 bytes to KMALLOC_MAX
+
+static struct KmemCache kmalloc_caches[KMALLOC_NCACHES];
+static char *kmalloc_names[KMALLOC_NCACHES] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+
+static void check_kmalloc(void);
+
+void
+kmem_cache_init(struct KmemCache *c, char *name, size_t size,
+		void (*ctor)(void *obj))
+{
+	size_t n;
+
+	memset(c, 0, sizeof(*c));
+	c->kc_name = name;
+	c->kc_size = ROUNDUP(MAX(size, 8), 8);
+	c->kc_ctor = ctor;
+	__spin_initlock(&c->kc_lock, name);
+
+	n = (PGSIZE - sizeof(struct Slab)) / (c->kc_size + sizeof(uint16_t));
+	while (n && ROUNDUP(sizeof(struct Slab) + n * sizeof(uint16_t), 16) +
+			    n * c->kc_size > PGSIZE)
+		n--;
+	if (!n)
+		panic("kmem_cache_init: %s: %u-byte objects do not fit a slab",
+		      name, size);
+	c->kc_nobjs = n;
+	c->kc_offset = ROUNDUP(sizeof(struct Slab) + n * sizeof(uint16_t), 16);
+}
+
+static void *
+slab_obj(struct KmemCache *c, struct Slab *s, int i)
+{
+	return (char *)s + c->kc_offset + i * c->kc_size;
+}
+
+static void
+slab_link(struct KmemCache *c, struct Slab *s)
+{
+	s->s_prev = NULL;
+	s->s_next = c->kc_partial;
+	if (s->s_next)
+		s->s_next->s_prev = s;
+	c->kc_partial = s;
+}
+
+static void
+slab_unlink(struct KmemCache *c, struct Slab *s)
+{
+	if (s->s_prev)
+		s->s_prev->s_next = s->s_next;
+	else
+		c->kc_partial = s->s_next;
+	if (s->s_next)
+		s->s_next->s_prev = s->s_prev;
+	s->s_next = s->s_prev = NULL;
+}
+
+// Make a slab of free, constructed objects.  Returns NULL if out of
+// memory.
+static struct Slab *
+slab_new(struct KmemCache *c)
+{
+	struct PageInfo *pp;
+	struct Slab *s;
+	int i;
+
+	if (!(pp = page_alloc(0)))
+		return NULL;
+	s = page2kva(pp);
+	s->s_next = s->s_prev = NULL;
+	s->s_cache = c;
+	s->s_inuse = 0;
+	s->s_free = 0;
+	for (i = 0; i < c->kc_nobjs; i++) {
+		s->s_link[i] = i + 1 < c->kc_nobjs ? i + 1 : SLAB_NONE;
+		if (c->kc_ctor)
+			c->kc_ctor(slab_obj(c, s, i));
+	}
+	return s;
+}
+
+// Return obj to its slab.  The caller holds c->kc_lock.
+static void
+slab_put(struct KmemCache *c, void *obj)
+{
+	struct Slab *s = ROUNDDOWN(obj, PGSIZE);
+	int i = ((char *)obj - (char *)s - c->kc_offset) / c->kc_size;
+
+	assert(s->s_cache == c);
+	assert(slab_obj(c, s, i) == obj);
+	if (s->s_inuse == c->kc_nobjs)
+		slab_link(c, s);
+	s->s_link[i] = s->s_free;
+	s->s_free = i;
+
+	// Keep one empty slab around, but no more.
+	if (--s->s_inuse == 0 && (s->s_next || s->s_prev)) {
+		slab_unlink(c, s);
+		page_free(pa2page(PADDR(s)));
+	}
+}
+
+// Move up to KMEM_BATCH objects from the slabs to this CPU.
+static void
+kmem_refill(struct KmemCache *c, struct KmemCpu *cc)
+{
+	struct Slab *s;
+	int i;
+
+	spin_lock(&c->kc_lock);
+	while (cc->kc_n < KMEM_BATCH) {
+		if (!(s = c->kc_partial)) {
+			// Constructors may be slow; run them unlocked.
+			spin_unlock(&c->kc_lock);
+			s = slab_new(c);
+			spin_lock(&c->kc_lock);
+			if (!s)
+				break;
+			slab_link(c, s);
+			continue;
+		}
+		i = s->s_free;
+		s->s_free = s->s_link[i];
+		if (++s->s_inuse == c->kc_nobjs)
+			slab_unlink(c, s);
+		cc->kc_objs[cc->kc_n++] = slab_obj(c, s, i);
+	}
+	spin_unlock(&c->kc_lock);
+}
+
+//
+// Allocate an object from cache c.  Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct KmemCache *c)
+{
+	struct KmemCpu *cc = &c->kc_cpu[thiscpu->cpu_id];
+
+	if (!cc->kc_n)
+		kmem_refill(c, cc);
+	if (!cc->kc_n)
+		return NULL;
+	return cc->kc_objs[--cc->kc_n];
+}
+
+//
+// Free an object allocated from cache c.
+//
+void
+kmem_cache_free(struct KmemCache *c, void *obj)
+{
+	struct KmemCpu *cc = &c->kc_cpu[thiscpu->cpu_id];
+
+	if (cc->kc_n == KMEM_CPU_MAX) {
+		spin_lock(&c->kc_lock);
+		while (cc->kc_n > KMEM_CPU_MAX - KMEM_BATCH)
+			slab_put(c, cc->kc_objs[--cc->kc_n]);
+		spin_unlock(&c->kc_lock);
+	}
+	cc->kc_objs[cc->kc_n++] = obj;
+}
+
+void
+kmalloc_init(void)
+{
+	int i;
+
+	for (i = 0; i < KMALLOC_NCACHES; i++)
+		kmem_cache_init(&kmalloc_caches[i], kmalloc_names[i], 16 << i,
+				NULL);
+	check_kmalloc();
+}
+
+//
+// Allocate size bytes, aligned to 16.
+// Returns NULL if out of memory or if size is 0 or more than
+// KMALLOC_MAX.
+//
+void *
+kmalloc(size_t size)
+{
+	int i;
+
+	if (!size || size > KMALLOC_MAX)
+		return NULL;
+	for (i = 0; (16 << i) < size; i++)
+		;
+	return kmem_cache_alloc(&kmalloc_caches[i]);
+}
+
+void
+kfree(void *obj)
+{
+	struct Slab *s;
+
+	if (!obj)
+		return;
+	s = ROUNDDOWN(obj, PGSIZE);
+	kmem_cache_free(s->s_cache, obj);
+}
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+#define CHECK_MAGIC 0x51AB51AB
+
+static void
+check_ctor(void *obj)
+{
+	*(uint32_t *)obj = CHECK_MAGIC;
+}
+
+static void
+check_kmalloc(void)
+{
+	static struct KmemCache cache;
+	void *objs[300];
+	char *p, *q;
+	int i, n;
+
+	// objects of each size are distinct, aligned and in the right cache
+	for (i = 0; i < KMALLOC_NCACHES; i++) {
+		assert((p = kmalloc(16 << i)));
+		assert((q = kmalloc((16 << i) - 1)));
+		assert(p != q);
+		assert((uintptr_t)p % 16 == 0 && (uintptr_t)q % 16 == 0);
+		assert(((struct Slab *)ROUNDDOWN(p, PGSIZE))->s_cache ==
+		       &kmalloc_caches[i]);
+		memset(p, 0xAA, 16 << i);
+		memset(q, 0x55, (16 << i) - 1);
+		assert(*p == (char)0xAA);
+		kfree(q);
+		// freed objects come back first
+		assert(kmalloc(16 << i) == q);
+		kfree(q);
+		kfree(p);
+	}
+	assert(!kmalloc(0));
+	assert(!kmalloc(KMALLOC_MAX + 1));
+
+	// the constructor runs once per object, over several slabs
+	kmem_cache_init(&cache, "check_kmalloc", 1000, check_ctor);
+	n = 3 * cache.kc_nobjs + 1;
+	assert(n <= sizeof(objs) / sizeof(objs[0]));
+	for (i = 0; i < n; i++) {
+		assert((objs[i] = kmem_cache_alloc(&cache)));
+		assert(*(uint32_t *)objs[i] == CHECK_MAGIC);
+	}
+	for (i = 0; i < n; i++)
+		assert(!i || objs[i] != objs[i - 1]);
+	for (i = 0; i < n; i++)
+		kmem_cache_free(&cache, objs[i]);
+	assert((p = kmem_cache_alloc(&cache)));
+	assert(*(uint32_t *)p == CHECK_MAGIC);
+	kmem_cache_free(&cache, p);
+
+	cprintf("check_kmalloc() succeeded!\n");
+}
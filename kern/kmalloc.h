@@ -0,0 +1,49 @@
+#ifndef JOS_KERN_KMALLOC_H
+#define JOS_KERN_KMALLOC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+// Objects a CPU keeps for itself, and how many it moves to or from
+// the shared slabs at a time.
+#define KMEM_CPU_MAX 32
+#define KMEM_BATCH 16
+
+// kmalloc serves sizes up to this; use page_alloc for more.
+#define KMALLOC_MAX 2048
+
+struct Slab;
+
+struct KmemCpu {
+	int kc_n;
+	void *kc_objs[KMEM_CPU_MAX];
+};
+
+// A cache of objects of one size, carved out of one-page slabs.
+// kc_ctor, if set, runs once on each object when its slab is made, and
+// objects must be in the constructed state again when they are freed.
+struct KmemCache {
+	char *kc_name;
+	size_t kc_size;			// Object size, rounded up
+	size_t kc_offset;		// Of the first object in a slab
+	uint16_t kc_nobjs;		// Objects per slab
+	void (*kc_ctor)(void *obj);
+	struct spinlock kc_lock;	// Guards kc_partial and the slabs
+	struct Slab *kc_partial;	// Slabs with free objects
+	struct KmemCpu kc_cpu[NCPU];
+};
+
+void kmem_cache_init(struct KmemCache *c, char *name, size_t size,
+		     void (*ctor)(void *obj));
+void *kmem_cache_alloc(struct KmemCache *c);
+void kmem_cache_free(struct KmemCache *c, void *obj);
+
+void kmalloc_init(void);
+void *kmalloc(size_t size);
+void kfree(void *obj);
+
+#endif	// !JOS_KERN_KMALLOC_H
@@ -9,6 +9,7 @@
 #include <inc/x86.h>
 #include <kern/pmap.h>
 #include <kern/cpu.h>
+#include <kern/time.h>
 
 // Local APIC registers, divided by 4 for use as uint32_t[] indices.
 #define ID      (0x0020/4)   // ID
@@ -45,6 +46,14 @@
 physaddr_t lapicaddr;        // Initialized in mpconfig.c
 volatile uint32_t *lapic;
 
+// Timer counts per millisecond, measured by the boot CPU.  All local
+// APICs share the bus clock, so the other CPUs use the same value.
+static uint32_t lapic_timer_khz;
+
+// Per CPU, the timer count at the last lapic_timer_oneshot or
+// lapic_timer_elapsed call.
+static uint32_t lapic_timer_base[NCPU];
+
 static void
 lapicw(int index, int value)
 {
@@ -52,6 +61,75 @@ lapicw(int index, int value)
 	lapic[ID];  // wait for write to finish, by reading
 }
 
+// Count how fast the timer runs: let it count down from its maximum
+// while PIT channel 2 counts down PIT_CALIBRATE_MS.
+static void
+lapic_timer_calibrate(void)
+{
+	uint32_t count;
+
+	lapicw(TIMER, MASKED);
+	pit_calibrate_start();
+	lapicw(TICR, 0xFFFFFFFF);
+	while (!pit_calibrate_done())
+		;
+	count = 0xFFFFFFFF - lapic[TCCR];
+	lapicw(TICR, 0);
+
+	lapic_timer_khz = count / PIT_CALIBRATE_MS;
+	if (!lapic_timer_khz) {
+		// No PIT; assume the old fixed setting was about 10 ms.
+		cprintf("lapic: timer calibration failed\n");
+		lapic_timer_khz = 1000000;
+	}
+}
+
+// Interrupt once, 'us' microseconds from now, replacing any
+// pending deadline.
+void
+lapic_timer_oneshot(uint32_t us)
+{
+	uint32_t count;
+
+	if (!lapic)
+		return;
+	count = (uint64_t)us * lapic_timer_khz / 1000;
+	if (count == 0)
+		count = 1;
+	lapicw(TIMER, IRQ_OFFSET + IRQ_TIMER);
+	lapicw(TICR, count);
+	lapic_timer_base[thiscpu->cpu_id] = count;
+}
+
+// Cancel any pending deadline.
+void
+lapic_timer_stop(void)
+{
+	if (!lapic)
+		return;
+	lapicw(TIMER, MASKED | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, 0);
+	lapic_timer_base[thiscpu->cpu_id] = 0;
+}
+
+// Return the microseconds counted down since the timer was armed or
+// since the last call, whichever is later.  A countdown stops at its
+// deadline, so time after that is not counted.
+uint32_t
+lapic_timer_elapsed(void)
+{
+	uint32_t *base, now, us;
+
+	if (!lapic)
+		return 0;
+	base = &lapic_timer_base[thiscpu->cpu_id];
+	now = lapic[TCCR];
+	us = (uint64_t)(*base - now) * 1000 / lapic_timer_khz;
+	// Keep the fraction of a microsecond for next time.
+	*base -= (uint64_t)us * lapic_timer_khz / 1000;
+	return us;
+}
+
 void
 lapic_init(void)
 {
@@ -65,13 +143,13 @@ lapic_init(void)
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// The timer counts down once at bus frequency from lapic[TICR]
+	// and then issues an interrupt.  The scheduler arms it for each
+	// deadline with lapic_timer_oneshot; until then it is stopped.
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	if (thiscpu == bootcpu)
+		lapic_timer_calibrate();
+	lapic_timer_stop();
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -173,6 +251,16 @@ lapic_startap(uint8_t apicid, uint32_t addr)
 	}
 }
 
+// Send an interrupt to the CPU with the given local APIC ID.
+void
+lapic_ipi_cpu(int apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
 void
 lapic_ipi(int vector)
 {
@@ -13,6 +13,7 @@
 #include <kern/kdebug.h>
 #include <kern/trap.h>
 #include <kern/pmap.h>
+#include <kern/spinlock.h>
 
 #define CMDBUF_SIZE 80 // enough for one VGA text line
 
@@ -29,6 +30,7 @@ static struct Command commands[] = {
 	{ "si", "Step single instruction", mon_step },
 	{ "c", "Continue environment execution", mon_user_continue },
 	{ "bt", "Backtrace", mon_backtrace },
+	{ "lockstat", "Show lock contention; 'lockstat reset' clears it", mon_lockstat },
 };
 #define NCOMMANDS (sizeof(commands) / sizeof(commands[0]))
 
@@ -60,6 +62,20 @@ mon_help(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+#ifdef LOCKSTAT
+	if (argc > 1 && strcmp(argv[1], "reset") == 0)
+		lockstat_reset();
+	else
+		lockstat_print();
+#else
+	cprintf("lockstat: kernel built without LOCKSTAT\n");
+#endif
+	return 0;
+}
+
 int
 mon_kerninfo(int argc, char **argv, struct Trapframe *tf)
 {
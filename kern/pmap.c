@@ -11,9 +11,12 @@
 #include <inc/assert.h>
 
 #include <kern/pmap.h>
+#include <kern/time.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/vma.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;		      // Amount of physical memory (in pages)
@@ -22,7 +25,69 @@ static size_t npages_basemem; // Amount of base memory (in pages)
 // These variables are set in mem_init()
 pde_t *kern_pgdir;			// Kernel's initial page directory
 struct PageInfo *pages;			// Physical page state array
-static struct PageInfo *page_free_list; // Free list of physical pages
+bool pse_enabled;			// CR4_PSE is set on every CPU
+bool pge_enabled;			// CR4_PGE is set on every CPU
+
+// The largest block the page allocator hands out: a superpage.
+#define MAX_ORDER SP_ORDER
+// Free blocks of 2^order pages, one list per order
+static struct PageInfo *free_area[MAX_ORDER + 1];
+
+// Guards free_area and the pp_ref of pages that may be shared
+// between address spaces.  Every CPU takes it, so it queues MCS-style.
+static struct spinlock page_lock = {
+	.mcs = 1,
+#ifdef DEBUG_SPINLOCK
+	.name = "page_lock"
+#endif
+};
+
+// Single free pages cached by each CPU in front of free_area, so that
+// page_alloc and page_free mostly touch nothing shared.  A CPU whose
+// cache runs dry takes PAGE_MAG_BATCH pages from free_area in one go,
+// and one whose cache fills up to PAGE_MAG_HIGH gives as many back.
+// The kernel runs with interrupts off, so a CPU's cache needs no lock.
+#define PAGE_MAG_HIGH 64
+#define PAGE_MAG_BATCH 32
+
+struct PageMag {
+	int pm_n;
+	struct PageInfo *pm_pages[PAGE_MAG_HIGH];
+};
+
+static struct PageMag page_mags[NCPU];
+
+// Free pages that idle CPUs have already zeroed (see page_zero_idle),
+// linked through pp_link.  page_alloc(ALLOC_ZERO) takes these first,
+// and any page_alloc does once the rest of memory has run out.
+#define ZERO_POOL_MAX 256
+
+static struct PageInfo *zero_pool;
+static volatile int zero_pool_n;
+static bool zero_nt; // Zero with movnti
+static struct spinlock zero_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "zero_lock"
+#endif
+};
+
+// TLB invalidations that other CPUs have to make, collected by each
+// CPU while it edits page tables (under env locks) and sent in one IPI
+// round by tlb_shootdown once it holds no locks.  Pages freed in the
+// meantime are held back until then, since the other CPUs may still
+// reach them through stale TLB entries.
+#define TLB_BATCH_MAX 16
+
+struct TlbBatch {
+	uint32_t tb_cpus;		  // CPUs to send the batch to
+	volatile uint8_t tb_pending[NCPU]; // Those yet to act on it
+	pde_t *tb_pgdir;		  // NULL if for several pgdirs
+	int tb_n;			  // > TLB_BATCH_MAX: flush it all
+	uintptr_t tb_va[TLB_BATCH_MAX];
+	struct PageInfo *tb_free;	  // Pages held back
+};
+
+static struct TlbBatch tlb_batches[NCPU];
 
 // --------------------------------------------------------------
 // Detect machine's physical memory setup.
@@ -63,6 +128,7 @@ i386_detect_memory(void)
 // --------------------------------------------------------------
 
 static void mem_init_mp(void);
+static void page_free_locked(struct PageInfo *pp);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size,
 			    physaddr_t pa, int perm);
 static void check_page_free_list(bool only_low_memory);
@@ -83,7 +149,7 @@ static void check_page_installed_pgdir(void);
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the free lists have been set up.
 static void *
 boot_alloc(uint32_t n)
 {
@@ -165,6 +231,10 @@ mem_init(void)
 	// LAB 3: Your code here.
 	envs = boot_alloc(NENV * sizeof(*envs));
 
+	//////////////////////////////////////////////////////////////////////
+	// Allocate the time page.  time_init fills it in.
+	timepage = boot_alloc(PGSIZE);
+
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
 	// up the list of free physical pages. Once we've done so, all further
@@ -186,6 +256,7 @@ mem_init(void)
 	//    - the new image at UPAGES -- kernel R, user R
 	//      (ie. perm = PTE_U | PTE_P)
 	//    - pages itself -- kernel RW, user NONE
+	//      (covered by the mapping of physical memory at KERNBASE)
 	// Your code goes here:
 	uintptr_t p;
 	size_t pi;
@@ -194,8 +265,6 @@ mem_init(void)
 		struct PageInfo *page = pa2page(PADDR((void *)p));
 		page_insert(kern_pgdir, page, (void *)(UPAGES + pi),
 			    PTE_U | PTE_P);
-		page_insert(kern_pgdir, page, (void *)(pages + pi),
-			    PTE_W | PTE_P);
 	}
 
 	//////////////////////////////////////////////////////////////////////
@@ -212,6 +281,13 @@ mem_init(void)
 			    PTE_U | PTE_P);
 	}
 
+	//////////////////////////////////////////////////////////////////////
+	// Map the time page read-only by the user at UTIME, which shares
+	// the UENVS page table.
+	static_assert(NENV * sizeof(struct Env) <= UTIME - UENVS);
+	page_insert(kern_pgdir, pa2page(PADDR(timepage)), (void *)UTIME,
+		    PTE_U | PTE_P);
+
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
 	// stack.  The kernel stack grows down from virtual address KSTACKTOP.
@@ -225,7 +301,7 @@ mem_init(void)
 	// Your code goes here:
 
 	boot_map_region(kern_pgdir, KSTACKTOP - KSTKSIZE, KSTKSIZE,
-			(physaddr_t)PADDR(percpu_kstacks[0]), PTE_W);
+			(physaddr_t)PADDR(percpu_kstacks[0]), PTE_W | PTE_G);
 	for (pi = 0; pi < (KSTACKTOP - KSTKSIZE) - (KSTACKTOP - PTSIZE);
 	     pi += PGSIZE) {
 		pte_t *pte = pgdir_walk(kern_pgdir,
@@ -243,20 +319,27 @@ mem_init(void)
 	// we just set up the mapping anyway.
 	// Permissions: kernel RW, user NONE
 	// Your code goes here:
-	if (true || !page_size_extension()) {
+	// The mapping is the same in every address space, so it is
+	// global if the CPU can do that: its TLB entries then survive
+	// the lcr3 of every context switch.  mp_main sets CR4_PGE (and
+	// CR4_PSE) on the other CPUs before they load kern_pgdir.
+	if (page_global_enable()) {
+		lcr4(rcr4() | CR4_PGE);
+		pge_enabled = true;
+	}
+	if (!page_size_extension()) {
 		boot_map_region(kern_pgdir, KERNBASE,
-				(0xffffffff - 0xf0000000) + 1, 0x0, PTE_W);
+				(0xffffffff - 0xf0000000) + 1, 0x0,
+				PTE_W | PTE_G);
 	} else { // Can use PSE optimization, turn on PSE flag in CR4
-		uint32_t cr4 = rcr4();
-		lcr4(cr4 | CR4_PSE);
-
-		uintptr_t va = KERNBASE;
-		size_t pj;
-		for (pi = 0; pi < 0xffffffff - 0xf0000000 + 1; pi += PTSIZE) {
-			pte_t *pde = &kern_pgdir[PDX(va + pi)];
-			physaddr_t pa = PADDR((void *)(va + pi));
-			*pde = pa | PTE_PS | PTE_W | PTE_P;
-		}
+		// With 4MB pages the direct map takes no page tables at
+		// all and only 64 TLB entries.
+		lcr4(rcr4() | CR4_PSE);
+		pse_enabled = true;
+
+		for (p = KERNBASE; p != 0; p += PTSIZE)
+			kern_pgdir[PDX(p)] = PADDR((void *)p) | PTE_PS | PTE_W |
+					     PTE_G | PTE_P;
 	}
 
 	// Initialize the SMP-related parts of the memory map
@@ -313,7 +396,8 @@ mem_init_mp(void)
 	for (cpui = 0; cpui < NCPU; cpui++) {
 		kstackbase_i = KSTACKTOP - (KSTKSIZE + KSTKGAP) * (cpui + 1);
 		boot_map_region(kern_pgdir, kstackbase_i + KSTKGAP, KSTKSIZE,
-				(physaddr_t)PADDR(percpu_kstacks[cpui]), PTE_W);
+				(physaddr_t)PADDR(percpu_kstacks[cpui]),
+				PTE_W | PTE_G);
 		for (pi = 0; pi < KSTKGAP; pi += PGSIZE) {
 			pte_t *pte =
 				pgdir_walk(kern_pgdir,
@@ -328,14 +412,15 @@ mem_init_mp(void)
 // --------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct PageInfo' entry per physical page.
-// Pages are reference counted, and free pages are kept on a linked list.
+// Pages are reference counted, and free pages are kept in blocks of
+// 2^order pages (a "buddy" allocator), on one linked list per order.
 // --------------------------------------------------------------
 
 //
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via free_area.
 //
 void
 page_init(void)
@@ -362,6 +447,8 @@ page_init(void)
 	// NB: DO NOT actually touch the physical memory corresponding to
 	// free pages!
 
+	zero_nt = sse2_supported();
+
 	pages[0].pp_ref = 1;
 	size_t i;
 	for (i = npages - 1; i >= 1; i--) {
@@ -380,61 +467,104 @@ page_init(void)
 		}
 
 		pages[i].pp_ref = 0;
-		pages[i].pp_link = page_free_list;
-		page_free_list = &pages[i];
+		page_free_locked(&pages[i]);
 	}
 }
 
-struct PageInfo *
-palloc(size_t power_of_two, int alloc_flags)
+// Put the free block pp of 2^order pages on its list.
+static void
+buddy_push(struct PageInfo *pp, unsigned order)
 {
-	if (!page_free_list)
-		return 0;
+	pp->pp_order = order;
+	pp->pp_free = 1;
+	pp->pp_prev = NULL;
+	pp->pp_link = free_area[order];
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp;
+	free_area[order] = pp;
+}
 
-	const size_t page_count = (1 << power_of_two);
-	size_t i;
-	struct PageInfo **left, **right = &page_free_list;
-	do {
-		if (!*right)
-			return 0;
-
-		left = right;
-		right = &(*right)->pp_link;
-		// search for contiguous memory rigion
-		for (i = 1; i < page_count; i++, right = &(*right)->pp_link) {
-			if (!*right) // reached end, could not find requested memory size
-				return 0;
-			if (*right != *left + i) // not contiguous
-				break;
-		}
-	} while (i != page_count);
+// Take the free block pp off its list.
+static void
+buddy_unlink(struct PageInfo *pp)
+{
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		free_area[pp->pp_order] = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	pp->pp_link = pp->pp_prev = NULL;
+	pp->pp_free = 0;
+}
 
-	// pop pages from page_free_list
-	struct PageInfo *result = *left;
-	*left = *right;
-	*right = NULL;
+// Takes a block of 2^order pages off the free lists: the first block of
+// the smallest order that is big enough, split in halves down to the
+// size asked for.  The caller holds page_lock.
+static struct PageInfo *
+buddy_alloc(unsigned order)
+{
+	struct PageInfo *pp;
+	unsigned o;
 
-	if (alloc_flags & ALLOC_ZERO) {
-		left = &result;
-		for (; *left; left = &(*left)->pp_link)
-			memset(page2kva(*left), 0, PGSIZE);
+	assert(order <= MAX_ORDER);
+	for (o = order; o <= MAX_ORDER && !free_area[o]; o++)
+		;
+	if (o > MAX_ORDER)
+		return NULL;
+
+	pp = free_area[o];
+	buddy_unlink(pp);
+	// Keep the lower half, free the upper one.
+	while (o > order) {
+		o--;
+		buddy_push(pp + (1 << o), o);
 	}
-	return result;
+	pp->pp_order = order;
+	return pp;
 }
 
-void
-pfree(struct PageInfo *pp)
+//
+// Allocates a block of 2^order physically contiguous pages, aligned to
+// its size.  If (alloc_flags & ALLOC_ZERO), fills the whole block with
+// '\0' bytes.  Like page_alloc, does NOT increment the reference count;
+// the first page's pp_order remembers the size for page_free.
+//
+// Returns NULL if there is no free block big enough.
+//
+struct PageInfo *
+page_alloc_order(unsigned order, int alloc_flags)
 {
-	struct PageInfo **prev, *end;
-	for (end = pp; end->pp_link; end = end->pp_link)
-		if (end->pp_ref)
-			panic("atempt to free a referenced page");
-
-	prev = &page_free_list;
-	while (*prev && page2pa((*prev)->pp_link) < page2pa(end))
-		prev = &(*prev)->pp_link;
-	(*prev)->pp_link->pp_link = end;
-	(*prev)->pp_link = pp;
+	struct PageInfo *pp;
+
+	if (order == 0)
+		return page_alloc(alloc_flags);
+
+	spin_lock(&page_lock);
+	pp = buddy_alloc(order);
+	spin_unlock(&page_lock);
+
+	if (pp && (alloc_flags & ALLOC_ZERO))
+		memset(page2kva(pp), 0, PGSIZE << order);
+	return pp;
+}
+
+// Takes a page off the zero pool, or returns NULL if it is empty.
+static struct PageInfo *
+zero_pool_get(void)
+{
+	struct PageInfo *pp;
+
+	if (!zero_pool_n)
+		return NULL;
+	spin_lock(&zero_lock);
+	if ((pp = zero_pool)) {
+		zero_pool = pp->pp_link;
+		pp->pp_link = NULL;
+		zero_pool_n--;
+	}
+	spin_unlock(&zero_lock);
+	return pp;
 }
 
 //
@@ -452,35 +582,125 @@ pfree(struct PageInfo *pp)
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
-	/* struct PageInfo *p = palloc(0, alloc_flags); */
-	/* cprintf("new page: %d\n", p - pages); */
-	/* return p; */
+	struct PageMag *m = &page_mags[thiscpu->cpu_id];
+	struct PageInfo *pp;
 
-	struct PageInfo *result = page_free_list;
-	if (!result)
-		return 0;
+	if ((alloc_flags & ALLOC_ZERO) && (pp = zero_pool_get()))
+		return pp;
 
-	page_free_list = page_free_list->pp_link;
-	result->pp_link = NULL;
-	if (alloc_flags & ALLOC_ZERO)
-		memset(page2kva(result), 0, PGSIZE);
+	if (!m->pm_n) {
+		spin_lock(&page_lock);
+		while (m->pm_n < PAGE_MAG_BATCH && (pp = buddy_alloc(0)))
+			m->pm_pages[m->pm_n++] = pp;
+		spin_unlock(&page_lock);
+		if (!m->pm_n)
+			return zero_pool_get();
+	}
+	pp = m->pm_pages[--m->pm_n];
 
-	return result;
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(pp), 0, PGSIZE);
+	return pp;
 }
 
 //
-// Return a page to the free list.
+// Return a page, or the block allocated with page_alloc_order that it
+// starts, to the free lists.
 // (This function should only be called when pp->pp_ref reaches 0.)
+// The block is merged with its buddy -- the other half of the block
+// of the next order up -- for as long as that is free as a whole.
 //
+static void
+page_free_locked(struct PageInfo *pp)
+{
+	struct PageInfo *buddy;
+	unsigned order = pp->pp_order;
+	size_t pn = pp - pages;
+
+	assert(!pp->pp_ref);
+	assert(!pp->pp_free);
+	while (order < MAX_ORDER) {
+		buddy = &pages[pn ^ (1 << order)];
+		if (buddy >= pages + npages || !buddy->pp_free ||
+		    buddy->pp_order != order)
+			break;
+		buddy_unlink(buddy);
+		// Only the first page of a block keeps its order.
+		buddy->pp_order = pages[pn].pp_order = 0;
+		pn &= ~(1 << order);
+		order++;
+	}
+	buddy_push(&pages[pn], order);
+}
+
 void
 page_free(struct PageInfo *pp)
 {
-	/* return pfree(pp); */
+	struct PageMag *m = &page_mags[thiscpu->cpu_id];
+
+	if (pp->pp_order) {
+		spin_lock(&page_lock);
+		page_free_locked(pp);
+		spin_unlock(&page_lock);
+		return;
+	}
 
 	assert(!pp->pp_ref);
-	pp->pp_link =
-		page_free_list; // FIXME? should be returning the page to its original location
-	page_free_list = pp;
+	pp->pp_link = NULL;
+	if (m->pm_n == PAGE_MAG_HIGH) {
+		spin_lock(&page_lock);
+		while (m->pm_n > PAGE_MAG_HIGH - PAGE_MAG_BATCH)
+			page_free_locked(m->pm_pages[--m->pm_n]);
+		spin_unlock(&page_lock);
+	}
+	m->pm_pages[m->pm_n++] = pp;
+}
+
+//
+// Zeroes one free page and adds it to the zero pool, for sched_idle to
+// call while the CPU has nothing better to do.  The stores bypass the
+// cache, so the page does not evict what the CPU will run next.
+// Returns false once the pool is full or memory has run out.
+//
+bool
+page_zero_idle(void)
+{
+	struct PageInfo *pp;
+
+	if (zero_pool_n >= ZERO_POOL_MAX || !(pp = page_alloc(0)))
+		return false;
+
+	if (zero_nt)
+		movnti_zero(page2kva(pp), PGSIZE / 4);
+	else
+		memset(page2kva(pp), 0, PGSIZE);
+
+	spin_lock(&zero_lock);
+	if (zero_pool_n < ZERO_POOL_MAX) {
+		pp->pp_link = zero_pool;
+		zero_pool = pp;
+		zero_pool_n++;
+		pp = NULL;
+	}
+	spin_unlock(&zero_lock);
+
+	if (pp) {
+		page_free(pp);
+		return false;
+	}
+	return true;
+}
+
+//
+// Increment the reference count on a page that may already be
+// mapped elsewhere.
+//
+void
+page_incref(struct PageInfo *pp)
+{
+	spin_lock(&page_lock);
+	pp->pp_ref++;
+	spin_unlock(&page_lock);
 }
 
 //
@@ -490,7 +710,19 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo *pp)
 {
-	if (--pp->pp_ref == 0)
+	struct TlbBatch *b = &tlb_batches[thiscpu->cpu_id];
+	bool last;
+
+	spin_lock(&page_lock);
+	last = --pp->pp_ref == 0;
+	spin_unlock(&page_lock);
+
+	if (!last)
+		return;
+	if (b->tb_cpus) {
+		pp->pp_link = b->tb_free;
+		b->tb_free = pp;
+	} else
 		page_free(pp);
 }
 
@@ -516,6 +748,10 @@ page_decref(struct PageInfo *pp)
 // Hint 3: look at inc/mmu.h for useful macros that mainipulate page
 // table and page directory entries.
 //
+// If 'va' is mapped by a superpage (PTE_PS), there is no page table;
+// pgdir_walk returns a pointer to the PDE, which plays the part of the
+// PTE for the whole 4MB, whatever 'create' says.
+//
 
 int mon_backtrace(int argc, char **argv, struct Trapframe *tf);
 
@@ -523,12 +759,8 @@ pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
 	pte_t *page_dir_entry = &pgdir[PDX(va)];
-	/* assert(!is_sp_entry(pgdir, (uintptr_t)va)); */
-	/* if (*page_dir_entry & PTE_PS) { */
-	/* pte_t fake_table_entry = *page_dir_entry; */
-	/* fake_table_entry += (PTX(va) << PTXSHIFT); */
-	/* return &fake_table_entry; */
-	/* } */
+	if (*page_dir_entry & PTE_PS)
+		return page_dir_entry;
 
 	if (!(*page_dir_entry & PTE_P)) {
 		if (!create)
@@ -574,6 +806,28 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa,
 	}
 }
 
+//
+// page_insert for a superpage.
+//
+static int
+page_insert_sp(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+
+	assert(pse_enabled);
+	if (SPGOFF(va))
+		return -E_INVAL;
+
+	if (!(*pde & PTE_PS) || PTE_ADDR(*pde) != page2pa(pp)) {
+		page_incref(pp);
+		page_remove_pde(pgdir, va);
+	}
+	*pde = page2pa(pp) | perm | PTE_PS | PTE_P;
+	tlb_invalidate(pgdir, va);
+
+	return 0;
+}
+
 //
 // Map the physical page 'pp' at virtual address 'va'.
 // The permissions (the low 12 bits) of the page table entry
@@ -592,9 +846,14 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa,
 // frequently leads to subtle bugs; there's an elegant way to handle
 // everything in one code path.
 //
+// A superpage (pp_order == SP_ORDER) is mapped with a single PDE and
+// replaces whatever was mapped in the 4MB at 'va'.  A page mapped where
+// a superpage was replaces the whole superpage.
+//
 // RETURNS:
 //   0 on success
 //   -E_NO_MEM, if page table couldn't be allocated
+//   -E_INVAL, if pp is a superpage and va is not 4MB-aligned
 //
 // Hint: The TA solution is implemented using pgdir_walk, page_remove,
 // and page2pa.
@@ -603,17 +862,27 @@ int
 page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
 	assert(!pp->pp_link);
+	assert(perm == (perm & 0xfff));
+	if (pp->pp_order == SP_ORDER)
+		return page_insert_sp(pgdir, pp, va, perm);
+	if (is_sp_entry(pgdir, (uintptr_t)va))
+		page_remove(pgdir, va);
+
 	pte_t *pte = pgdir_walk(pgdir, va, true);
 	if (!pte)
 		return -E_NO_MEM;
 
 	if (PTE_ADDR(*pte) != page2pa(pp)) {
-		pp->pp_ref++;
+		page_incref(pp);
 		if (*pte & PTE_P) // pp already mapped to va
 			page_remove(pgdir, va);
+	} else if (*pte & PTE_P) {
+		// only the permissions change
+		*pte = page2pa(pp) | perm | PTE_P;
+		tlb_invalidate(pgdir, va);
+		return 0;
 	}
 
-	assert(perm == (perm & 0xfff));
 	*pte = page2pa(pp) | perm | PTE_P;
 
 	return 0;
@@ -627,6 +896,7 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 // but should not be used by most callers.
 //
 // Return NULL if there is no page mapped at va.
+// For a superpage, this is its first page, and the PTE is its PDE.
 //
 // Hint: the TA solution uses pgdir_walk and pa2page.
 //
@@ -649,6 +919,7 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 //
 // Unmaps the physical page at virtual address 'va'.
 // If there is no physical page at that address, silently does nothing.
+// If 'va' is in a superpage, the whole superpage is unmapped.
 //
 // Details:
 //   - The ref count on the physical page should decrement.
@@ -670,20 +941,194 @@ page_remove(pde_t *pgdir, void *va)
 		return;
 
 	*pte = 0;
+	tlb_invalidate(pgdir, va);
 	page_decref(page);
+}
+
+//
+// Resolves a write fault at 'va' on a copy-on-write page in 'pgdir'.
+// If no other mapping of the page is left, it simply becomes writable
+// again; otherwise 'va' gets a private writable copy of it.  This
+// works the same for a superpage, 4MB at a time.
+// The caller holds the lock of the env owning 'pgdir'.
+//
+// RETURNS:
+//   0 on success
+//   -E_FAULT, if 'va' is not a copy-on-write user page
+//   -E_NO_MEM, if there is no memory for the copy
+//
+int
+page_cow(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp, *copy;
+	pte_t *pte;
+	bool shared;
+
+	pp = page_lookup(pgdir, va, &pte);
+	if (!pp || (*pte & (PTE_U | PTE_COW)) != (PTE_U | PTE_COW))
+		return -E_FAULT;
+	va = ROUNDDOWN(va, (*pte & PTE_PS) ? PTSIZE : PGSIZE);
+
+	spin_lock(&page_lock);
+	shared = pp->pp_ref > 1;
+	spin_unlock(&page_lock);
+
+	if (!shared) {
+		*pte = (*pte & ~PTE_COW) | PTE_W;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+
+	if (pp->pp_order == SP_ORDER) {
+		if (!(copy = page_alloc_order(SP_ORDER, 0)))
+			return -E_NO_MEM;
+		memcpy(page2kva(copy), page2kva(pp), PTSIZE);
+	} else if (pp == vma_zero_page) {
+		if (!(copy = page_alloc(ALLOC_ZERO)))
+			return -E_NO_MEM;
+	} else {
+		if (!(copy = page_alloc(0)))
+			return -E_NO_MEM;
+		memcpy(page2kva(copy), page2kva(pp), PGSIZE);
+	}
+	// The page table is there already, so this cannot fail.
+	page_insert(pgdir, copy, va, (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W);
+	return 0;
+}
+
+//
+// Unmaps everything mapped through the PDE for 'va' in 'pgdir' -- a
+// superpage, or all the pages in a page table -- and frees the page
+// table, if there is one.
+//
+void
+page_remove_pde(pde_t *pgdir, void *va)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	pte_t *pt;
+	uint32_t pteno;
+	physaddr_t pa;
+
+	if (!(*pde & PTE_P))
+		return;
+	if (*pde & PTE_PS) {
+		page_remove(pgdir, va);
+		return;
+	}
+
+	pa = PTE_ADDR(*pde);
+	pt = (pte_t *)KADDR(pa);
+	for (pteno = 0; pteno <= PTX(~0); pteno++) {
+		if (pt[pteno] & PTE_P)
+			page_remove(pgdir, PGADDR(PDX(va), pteno, 0));
+	}
+	*pde = 0;
 	tlb_invalidate(pgdir, va);
+	page_decref(pa2page(pa));
 }
 
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
+// Other CPUs running on 'pgdir' are told to do the same at the next
+// tlb_shootdown.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
+	struct TlbBatch *b = &tlb_batches[thiscpu->cpu_id];
+	struct Env *e;
+	uint32_t mask = 0;
+	int i;
+
 	// Flush the entry only if we're modifying the current address space.
 	if (!curenv || curenv->env_pgdir == pgdir)
 		invlpg(va);
+
+	// The caller holds the lock of the env owning 'pgdir', so no
+	// other CPU can start running on it now.
+	for (i = 0; i < ncpu; i++)
+		if (&cpus[i] != thiscpu && (e = cpus[i].cpu_env) &&
+		    e->env_pgdir == pgdir)
+			mask |= 1 << i;
+	if (!mask)
+		return;
+
+	if (!b->tb_cpus)
+		b->tb_pgdir = pgdir;
+	else if (b->tb_pgdir != pgdir)
+		b->tb_pgdir = NULL;
+	b->tb_cpus |= mask;
+	if (b->tb_n < TLB_BATCH_MAX)
+		b->tb_va[b->tb_n] = (uintptr_t)va;
+	if (b->tb_n <= TLB_BATCH_MAX)
+		b->tb_n++;
+}
+
+//
+// Sends this CPU's pending invalidations to the CPUs concerned and
+// waits until they have all acted on them; then frees the pages held
+// back.  The caller must not hold any spinlock, since the other CPUs
+// may have to get one before they see the IPI.
+//
+void
+tlb_shootdown(void)
+{
+	struct TlbBatch *b = &tlb_batches[thiscpu->cpu_id];
+	struct PageInfo *pp;
+	int i;
+	bool waiting;
+
+	if (!b->tb_cpus)
+		return;
+
+	for (i = 0; i < ncpu; i++)
+		b->tb_pending[i] = (b->tb_cpus >> i) & 1;
+	// The batch is complete before any CPU sees its IPI.
+	asm volatile("mfence" ::: "memory");
+	for (i = 0; i < ncpu; i++)
+		if (b->tb_pending[i])
+			lapic_ipi_cpu(cpus[i].cpu_id, T_TLBFLUSH);
+
+	// Interrupts are off, so serve whatever other CPUs send us
+	// meanwhile, or two CPUs shooting at each other would wait for
+	// ever.
+	do {
+		tlb_shootdown_recv();
+		waiting = false;
+		for (i = 0; i < ncpu; i++)
+			waiting |= b->tb_pending[i];
+		asm volatile("pause");
+	} while (waiting);
+
+	b->tb_cpus = 0;
+	b->tb_n = 0;
+	while ((pp = b->tb_free)) {
+		b->tb_free = pp->pp_link;
+		page_free(pp);
+	}
+}
+
+//
+// Acts on the invalidations other CPUs have sent this one.
+//
+void
+tlb_shootdown_recv(void)
+{
+	struct TlbBatch *b;
+	int i, me = thiscpu->cpu_id;
+	physaddr_t cr3 = rcr3();
+
+	for (b = tlb_batches; b < tlb_batches + ncpu; b++) {
+		if (!b->tb_pending[me])
+			continue;
+		if (!b->tb_pgdir || b->tb_n > TLB_BATCH_MAX)
+			lcr3(cr3);
+		else if (cr3 == PADDR(b->tb_pgdir))
+			for (i = 0; i < b->tb_n; i++)
+				invlpg((void *)b->tb_va[i]);
+		b->tb_pending[me] = 0;
+	}
 }
 
 //
@@ -720,7 +1165,7 @@ mmio_map_region(physaddr_t pa, size_t size)
 	// Your code here:
 	uintptr_t prev_base = base;
 	boot_map_region(kern_pgdir, ROUNDDOWN(base, PGSIZE),
-			ROUNDUP(size, PGSIZE), pa, PTE_PCD | PTE_PWT | PTE_W);
+			ROUNDUP(size, PGSIZE), pa, PTE_PCD | PTE_PWT | PTE_W | PTE_G);
 	base = ROUNDUP(base + size, PGSIZE);
 	return (void *)prev_base;
 }
@@ -742,6 +1187,10 @@ static uintptr_t user_mem_check_addr;
 // If there is an error, set the 'user_mem_check_addr' variable to the first
 // erroneous virtual address.
 //
+// Every bit of 'perm' must be set in the page's own entry.  A
+// copy-on-write page is not writable: the kernel must not write to it
+// before page_cow has given the env a copy of its own.
+//
 // Returns 0 if the user program can access this range of addresses,
 // and -E_FAULT otherwise.
 //
@@ -756,9 +1205,9 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 
 	void const *addr = va;
 	for (; ROUNDDOWN(addr, PGSIZE) < va + len; addr += PGSIZE) {
-		pte_t *pte = pgdir_walk(curenv->env_pgdir, addr, 0);
-		if (!pte || !(curenv->env_pgdir[PDX(addr)] & perm) ||
-		    !(*pte & PTE_U)) {
+		pte_t *pte = pgdir_walk(env->env_pgdir, addr, 0);
+		if (!pte || (*pte & (perm | PTE_P)) != (perm | PTE_P) ||
+		    ((perm & PTE_W) && (*pte & PTE_COW))) {
 			user_mem_check_addr =
 				(uintptr_t)ROUNDDOWN(addr, PGSIZE);
 			if (user_mem_check_addr < (uintptr_t)va)
@@ -775,14 +1224,21 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 // If it can, then the function simply returns.
 // If it cannot, 'env' is destroyed and, if env is the current
 // environment, this function will not return.
+// The caller must not hold env's lock.
 //
 void
 user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 {
+	if (user_mem_check(env, va, len, perm | PTE_U) == 0)
+		return;
+	// Demand-zero pages the env has not touched yet are mapped now,
+	// and copy-on-write pages about to be written are copied.
+	vma_populate(env, va, len, perm & PTE_W);
 	if (user_mem_check(env, va, len, perm | PTE_U) < 0) {
 		cprintf("[%08x] user_mem_check assertion failure for "
 			"va %08x\n",
 			env->env_id, user_mem_check_addr);
+		env_lock(env);
 		env_destroy(env); // may not return
 	}
 }
@@ -792,68 +1248,127 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 // --------------------------------------------------------------
 
 //
-// Check that the pages on the page_free_list are reasonable.
+// Check that the pages on the free lists are reasonable.
 //
 static void
 check_page_free_list(bool only_low_memory)
 {
-	struct PageInfo *pp;
+	struct PageInfo *pp, *p;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
 	char *first_free_page;
+	unsigned order;
 
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
+	for (order = 0; order <= MAX_ORDER && !free_area[order]; order++)
+		;
+	if (order > MAX_ORDER)
+		panic("'free_area' is empty!");
 
 	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
+		// Move blocks with lower addresses first in each free
 		// list, since entry_pgdir does not map all pages.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
+		for (order = 0; order <= MAX_ORDER; order++) {
+			struct PageInfo *pp1, *pp2, *prev = NULL;
+			struct PageInfo **tp[2] = { &pp1, &pp2 };
+			for (pp = free_area[order]; pp; pp = pp->pp_link) {
+				int pagetype = PDX(page2pa(pp)) >= pdx_limit;
+				*tp[pagetype] = pp;
+				tp[pagetype] = &pp->pp_link;
+			}
+			*tp[1] = 0;
+			*tp[0] = pp2;
+			free_area[order] = pp1;
+			for (pp = pp1; pp; prev = pp, pp = pp->pp_link)
+				pp->pp_prev = prev;
 		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
 	}
 
 	// if there's a page that shouldn't be on the free list,
 	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);
+	for (order = 0; order <= MAX_ORDER; order++)
+		for (pp = free_area[order]; pp; pp = pp->pp_link)
+			for (p = pp; p < pp + (1 << order); p++)
+				if (PDX(page2pa(p)) < pdx_limit)
+					memset(page2kva(p), 0x97, 128);
 
 	first_free_page = (char *)boot_alloc(0);
-	size_t list_size = 0;
-	for (pp = page_free_list; pp; pp = pp->pp_link, list_size++) {
-		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *)pp - (char *)pages) % sizeof(*pp) == 0);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM ||
-		       (char *)page2kva(pp) >= first_free_page);
-		// (new test for lab 4)
-		assert(page2pa(pp) != MPENTRY_PADDR);
-
-		if (page2pa(pp) < EXTPHYSMEM)
-			++nfree_basemem;
-		else
-			++nfree_extmem;
-	}
+	for (order = 0; order <= MAX_ORDER; order++)
+		for (pp = free_area[order]; pp; pp = pp->pp_link) {
+			// check that we didn't corrupt the free list itself
+			assert(pp >= pages);
+			assert(pp + (1 << order) <= pages + npages);
+			assert(((char *)pp - (char *)pages) % sizeof(*pp) == 0);
+			assert(((pp - pages) & ((1 << order) - 1)) == 0);
+			assert(pp->pp_free && pp->pp_order == order);
+			assert(!pp->pp_link || pp->pp_link->pp_prev == pp);
+
+			for (p = pp; p < pp + (1 << order); p++) {
+				// check a few pages that shouldn't be on the
+				// free list
+				assert(!p->pp_ref);
+				assert(page2pa(p) != 0);
+				assert(page2pa(p) != IOPHYSMEM);
+				assert(page2pa(p) != EXTPHYSMEM - PGSIZE);
+				assert(page2pa(p) != EXTPHYSMEM);
+				assert(page2pa(p) < EXTPHYSMEM ||
+				       (char *)page2kva(p) >= first_free_page);
+				// (new test for lab 4)
+				assert(page2pa(p) != MPENTRY_PADDR);
+
+				if (page2pa(p) < EXTPHYSMEM)
+					++nfree_basemem;
+				else
+					++nfree_extmem;
+			}
+		}
 
 	assert(nfree_basemem > 0);
 	assert(nfree_extmem > 0);
 }
 
+// Count the free pages, cached ones included.
+static int
+check_nfree(void)
+{
+	struct PageInfo *pp;
+	unsigned order;
+	int nfree = 0;
+
+	for (order = 0; order <= MAX_ORDER; order++)
+		for (pp = free_area[order]; pp; pp = pp->pp_link)
+			nfree += 1 << order;
+	for (order = 0; order < NCPU; order++)
+		nfree += page_mags[order].pm_n;
+	return nfree + zero_pool_n;
+}
+
+// Allocate every free page, so the checks can run out of memory.
+// Returns the pages linked through pp_link.
+static struct PageInfo *
+check_steal_free(void)
+{
+	struct PageInfo *pp, *fl = NULL;
+
+	while ((pp = page_alloc(0))) {
+		pp->pp_link = fl;
+		fl = pp;
+	}
+	return fl;
+}
+
+// Give back the pages taken by check_steal_free.
+static void
+check_return_free(struct PageInfo *fl)
+{
+	struct PageInfo *pp;
+
+	while ((pp = fl)) {
+		fl = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free(pp);
+	}
+}
+
 //
 // Check the physical page allocator (page_alloc(), page_free(),
 // and page_init()).
@@ -871,8 +1386,7 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = check_nfree();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -888,8 +1402,7 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages * PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -917,7 +1430,7 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -925,9 +1438,7 @@ check_page_alloc(void)
 	page_free(pp2);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	assert(check_nfree() == nfree);
 
 	cprintf("check_page_alloc() succeeded!\n");
 }
@@ -958,6 +1469,9 @@ check_kern_pgdir(void)
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
 
+	// check time page
+	assert(check_va2pa(pgdir, UTIME) == PADDR(timepage));
+
 	// check phys mem
 	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
@@ -1040,8 +1554,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1162,7 +1675,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free(fl);
 
 	// free the pages we took
 	page_free(pp0);
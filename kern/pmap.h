@@ -51,19 +51,34 @@ enum {
 	ALLOC_ZERO = 1 << 0,
 };
 
+// A superpage is a block of 2^SP_ORDER physical pages, mapped by a
+// single PDE with PTE_PS.  Its first page's pp_order is SP_ORDER and
+// its pp_ref counts the mappings of the whole block.
+#define SP_ORDER	(PTSHIFT - PGSHIFT)
+
+// Whether the CPUs have PSE turned on, so PTE_PS may be used.
+extern bool pse_enabled;
+// Whether the CPUs have PGE turned on, so PTE_G takes effect.
+extern bool pge_enabled;
+
 void mem_init(void);
 
 void page_init(void);
-struct PageInfo *palloc(size_t power_of_two, int alloc_flags);
-void pfree(struct PageInfo *pp);
 struct PageInfo *page_alloc(int alloc_flags);
+struct PageInfo *page_alloc_order(unsigned order, int alloc_flags);
 void page_free(struct PageInfo *pp);
+bool page_zero_idle(void);
 int page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void page_remove(pde_t *pgdir, void *va);
+void page_remove_pde(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
+void page_incref(struct PageInfo *pp);
 void page_decref(struct PageInfo *pp);
+int page_cow(pde_t *pgdir, void *va);
 
 void tlb_invalidate(pde_t *pgdir, void *va);
+void tlb_shootdown(void);
+void tlb_shootdown_recv(void);
 
 void *mmio_map_region(physaddr_t pa, size_t size);
 
@@ -94,17 +109,21 @@ page2kva(struct PageInfo *pp)
 
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
 
+// Whether 'va' is mapped by a 4MB superpage in 'pgdir'.
 static inline bool
-is_sp_entry(pte_t *pgdir, uintptr_t va)
+is_sp_entry(pde_t *pgdir, uintptr_t va)
 {
-	return pgdir[PTE_ADDR(va)] & PTE_PS;
+	return pgdir[PDX(va)] & PTE_PS;
 }
 
+// The physical address that 'va' translates to through 'pte', its
+// entry as returned by pgdir_walk (the PDE, for a superpage).
 static inline physaddr_t
-get_sp_entry(pte_t *pgdir, uintptr_t va, off_t offset)
+pte2pa(pte_t pte, const void *va)
 {
-	uintptr_t page_addr = PDX(pgdir[PDX(va)]) << PDXSHIFT;
-	return page_addr | SPGOFF(offset);
+	if (pte & PTE_PS)
+		return PTE_ADDR(pte) | SPGOFF(va);
+	return PTE_ADDR(pte) | PGOFF(va);
 }
 
 #endif /* !JOS_KERN_PMAP_H */
@@ -4,7 +4,14 @@
 #include <inc/types.h>
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
+#include <kern/spinlock.h>
 
+// Keeps messages from different CPUs from interleaving.
+static struct spinlock printf_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "printf_lock"
+#endif
+};
 
 static void
 putch(int ch, int *cnt)
@@ -16,9 +23,15 @@ putch(int ch, int *cnt)
 int
 vcprintf(const char *fmt, va_list ap)
 {
+	extern const char *panicstr;
 	int cnt = 0;
 
+	// After a panic, print even if the panicking CPU held the lock.
+	if (!panicstr)
+		spin_lock(&printf_lock);
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	if (!panicstr)
+		spin_unlock(&printf_lock);
 	return cnt;
 }
 
@@ -1,61 +1,371 @@
 #include <inc/assert.h>
 #include <inc/x86.h>
+#include <inc/trap.h>
 #include <kern/spinlock.h>
+#include <kern/cpu.h>
+#include <kern/sched.h>
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
 
 static char *env_stat_str_map[] = { "FREE", " DYING", "RUNNABLE", "RUNNING", "NOT_RUNNABLE" };
-void sched_halt(void);
+void sched_halt(void) __attribute__((noreturn));
+
+// Per-CPU queues of ENV_RUNNABLE environments.  An env joins the
+// queue of the CPU that made it runnable, and an idle CPU steals from
+// the longest queue.
+//
+// Each queue holds two scheduling classes.  Real-time envs (the
+// device servers and their helpers) wait on a FIFO linked through
+// env_rq_link and always run before fair envs.  Fair envs wait in a
+// min-heap ordered by virtual runtime, which grows more slowly for
+// envs of higher priority, so each gets CPU time in proportion to its
+// weight.
+//
+// Entries are removed lazily: an env that stopped being runnable
+// while queued stays queued (env_rq_queued remains set) and is
+// dropped when it reaches the front.  Heap entries carry their own
+// key, so a stale entry never breaks the heap order.
+//
+// env_rq_queued is only changed with xchg.  A waker sets the status
+// and then the flag; a dequeuer clears the flag and then reads the
+// status.  Either the waker sees the flag clear and queues the env
+// again, or the dequeuer sees the new status, so no wakeup is lost.
+struct RunQueueEntry {
+	uint64_t rqe_vruntime;
+	struct Env *rqe_env;
+};
+
+struct RunQueue {
+	struct spinlock rq_lock;
+	struct Env *rq_rt_head; // Real-time class, FIFO
+	struct Env *rq_rt_tail;
+	struct RunQueueEntry rq_fair[NENV]; // Fair class, min-heap
+	int rq_nfair;
+	int rq_len;		 // Entries in both classes
+	uint64_t rq_min_vruntime; // Never decreases
+};
+
+static struct RunQueue runqueues[NCPU];
+
+// Time slice for envs whose env_quantum is 0.
+unsigned sched_quantum = SCHED_QUANTUM;
+
+// Weight of each priority level, indexed by priority - ENV_PRIO_MIN.
+// Priority 0 has weight 1024 and each level is worth about 1.25x the
+// CPU time of the next one (the CFS nice table).
+static const uint32_t prio_to_weight[ENV_PRIO_MAX - ENV_PRIO_MIN + 1] = {
+	88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916,
+	9548,  7620,  6100,  4904,  3906,  3121,  2501,  1991,  1586,  1277,
+	1024,  820,   655,   526,   423,   335,   272,   215,   172,   137,
+	110,   87,    70,    56,    45,    36,    29,    23,    18,    15,
+};
+
 
-// Choose a user environment to run and run it.
 void
-sched_yield(void)
+sched_init(void)
 {
-	struct Env *idle;
-
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
-	//
-	// If no envs are runnable, but the environment previously
-	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment.
-	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
-
-	// LAB 4: Your code here.
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		__spin_initlock(&runqueues[i].rq_lock, "runqueue");
+}
+
+static void
+fair_push(struct RunQueue *rq, struct Env *e)
+{
+	struct RunQueueEntry tmp;
+	int i, parent;
+
+	i = rq->rq_nfair++;
+	rq->rq_fair[i].rqe_vruntime = e->env_vruntime;
+	rq->rq_fair[i].rqe_env = e;
+	for (; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (rq->rq_fair[parent].rqe_vruntime <= rq->rq_fair[i].rqe_vruntime)
+			break;
+		tmp = rq->rq_fair[parent];
+		rq->rq_fair[parent] = rq->rq_fair[i];
+		rq->rq_fair[i] = tmp;
+	}
+}
+
+static struct RunQueueEntry
+fair_pop(struct RunQueue *rq)
+{
+	struct RunQueueEntry top, tmp;
+	int i, child;
+
+	top = rq->rq_fair[0];
+	rq->rq_fair[0] = rq->rq_fair[--rq->rq_nfair];
+	for (i = 0; (child = 2 * i + 1) < rq->rq_nfair; i = child) {
+		if (child + 1 < rq->rq_nfair &&
+		    rq->rq_fair[child + 1].rqe_vruntime < rq->rq_fair[child].rqe_vruntime)
+			child++;
+		if (rq->rq_fair[i].rqe_vruntime <= rq->rq_fair[child].rqe_vruntime)
+			break;
+		tmp = rq->rq_fair[child];
+		rq->rq_fair[child] = rq->rq_fair[i];
+		rq->rq_fair[i] = tmp;
+	}
+	return top;
+}
+
+// Add 'e' to this CPU's run queue, unless it is already queued.
+// Returns whether it was added.
+static bool
+runq_push(struct Env *e)
+{
+	struct RunQueue *rq = &runqueues[thiscpu->cpu_id];
+
+	if (xchg(&e->env_rq_queued, 1))
+		return false;
+
+	spin_lock(&rq->rq_lock);
+	rq->rq_len++;
+	if (e->env_sched_class == ENV_SCHED_RT) {
+		e->env_rq_link = NULL;
+		if (rq->rq_rt_tail)
+			rq->rq_rt_tail->env_rq_link = e;
+		else
+			rq->rq_rt_head = e;
+		rq->rq_rt_tail = e;
+	} else {
+		// An env that slept or is new starts level with
+		// the queue instead of with a huge credit.
+		if (e->env_vruntime < rq->rq_min_vruntime)
+			e->env_vruntime = rq->rq_min_vruntime;
+		fair_push(rq, e);
+	}
+	spin_unlock(&rq->rq_lock);
+	return true;
+}
+
+// Idle CPUs halt with their timer stopped.  Wake one with a
+// reschedule IPI to steal newly queued work.  The waker claims the
+// CPU by marking it started, so a burst of wakeups reaches a
+// different halted CPU each time.
+static void
+sched_wake(void)
+{
+	int i;
+
+	// Make the queued work visible before reading the CPU states
+	// (see sched_idle).
+	asm volatile("mfence" ::: "memory");
+	for (i = 0; i < ncpu; i++)
+		if (i != thiscpu->cpu_id && cpus[i].cpu_status == CPU_HALTED &&
+		    cmpxchg(&cpus[i].cpu_status, CPU_HALTED, CPU_STARTED) == CPU_HALTED) {
+			lapic_ipi_cpu(cpus[i].cpu_id, T_RESCHED);
+			return;
+		}
+}
+
+// Queue 'e' to run and wake an idle CPU for it.
+// The caller holds e's lock and has just made e ENV_RUNNABLE.
+void
+sched_enqueue(struct Env *e)
+{
+	if (runq_push(e))
+		sched_wake();
+}
+
+// Remove and return the next ENV_RUNNABLE env on 'rq', discarding
+// stale entries on the way.  Returns NULL if there is none.
+// The status is read without the env's lock; the caller rechecks it.
+static struct Env *
+runq_pop(struct RunQueue *rq)
+{
+	struct RunQueueEntry ent;
+	struct Env *e;
+
+	spin_lock(&rq->rq_lock);
+	while ((e = rq->rq_rt_head)) {
+		rq->rq_rt_head = e->env_rq_link;
+		if (!rq->rq_rt_head)
+			rq->rq_rt_tail = NULL;
+		rq->rq_len--;
+		e->env_rq_link = NULL;
+		xchg(&e->env_rq_queued, 0);
+		if (e->env_status == ENV_RUNNABLE)
+			goto out;
+	}
+	while (rq->rq_nfair > 0) {
+		ent = fair_pop(rq);
+		e = ent.rqe_env;
+		rq->rq_len--;
+		if (ent.rqe_vruntime > rq->rq_min_vruntime)
+			rq->rq_min_vruntime = ent.rqe_vruntime;
+		xchg(&e->env_rq_queued, 0);
+		if (e->env_status == ENV_RUNNABLE)
+			goto out;
+	}
+	e = NULL;
+out:
+	spin_unlock(&rq->rq_lock);
+	return e;
+}
+
+// Move a fair env taken from 'from' onto this CPU's virtual clock,
+// keeping its lead or lag relative to the queue it left.
+static void
+runq_migrate(struct Env *e, struct RunQueue *from)
+{
+	struct RunQueue *to = &runqueues[thiscpu->cpu_id];
+
+	if (e->env_sched_class == ENV_SCHED_RT)
+		return;
+	if (e->env_vruntime >= from->rq_min_vruntime)
+		e->env_vruntime = e->env_vruntime - from->rq_min_vruntime + to->rq_min_vruntime;
+	else
+		e->env_vruntime = to->rq_min_vruntime;
+}
 
+// Take a runnable env from another CPU's queue, preferring the
+// longest one.  The lengths are read without locks; they only pick
+// the victim.
+static struct Env *
+runq_steal(void)
+{
+	struct Env *e;
+	int i, me, busiest;
+
+	me = thiscpu->cpu_id;
+	busiest = -1;
+	for (i = 0; i < ncpu; i++)
+		if (i != me && runqueues[i].rq_len > 0 &&
+		    (busiest < 0 || runqueues[i].rq_len > runqueues[busiest].rq_len))
+			busiest = i;
+	if (busiest < 0)
+		return NULL;
+	if ((e = runq_pop(&runqueues[busiest]))) {
+		runq_migrate(e, &runqueues[busiest]);
+		return e;
+	}
+
+	// The busiest queue held only stale entries; try the rest.
+	for (i = 0; i < ncpu; i++)
+		if (i != me && i != busiest && (e = runq_pop(&runqueues[i]))) {
+			runq_migrate(e, &runqueues[i]);
+			return e;
+		}
+	return NULL;
+}
+
+// Length of e's time slice in microseconds.
+static uint32_t
+sched_slice_us(struct Env *e)
+{
+	return (e->env_quantum ? e->env_quantum : sched_quantum) * SCHED_TICK_US;
+}
+
+// Charge the time since the timer was last read to the env loaded on
+// this CPU, in real time against its slice and in weighted time
+// against its virtual runtime.
+static void
+sched_charge(void)
+{
+	uint32_t us;
+
+	us = lapic_timer_elapsed();
 	if (!curenv)
-		idle = envs;
+		return;
+	curenv->env_slice += us;
+	curenv->env_vruntime += (uint64_t)us * prio_to_weight[0 - ENV_PRIO_MIN] /
+				prio_to_weight[curenv->env_priority - ENV_PRIO_MIN];
+}
+
+// Set this CPU's timer for its next deadline: the end of the time
+// slice of 'e', the env about to run.  An idle CPU (e == NULL) needs
+// no timer at all.
+static void
+sched_timer_arm(struct Env *e)
+{
+	if (!e)
+		lapic_timer_stop();
+	else if (e->env_slice < sched_slice_us(e))
+		lapic_timer_oneshot(sched_slice_us(e) - e->env_slice);
 	else
-		idle = envs + ((curenv + 1) - envs) % NENV;
-	do {
-		if (idle->env_id)
-			/* cprintf("sched: env_id: %d, stat: %s\n", idle->env_id, stats[idle->env_status]); */
-			if (idle->env_status == ENV_RUNNABLE)
-				env_run(idle);
-		idle = envs + ((idle + 1) - envs) % NENV;
-	} while ((curenv && idle != curenv) || (!curenv && idle != envs));
-
-	if (curenv && curenv->env_status == ENV_RUNNING)
-		env_run(curenv);
+		lapic_timer_oneshot(1);
+}
+
+// Choose a user environment to run and run it.
+void
+sched_yield(void)
+{
+	struct Env *e, *busy[NCPU];
+	int i, nbusy = 0;
+
+	tlb_shootdown();
+	sched_charge();
+
+	// The env this CPU was running goes back on the local queue:
+	// behind the other real-time envs, or at the place its virtual
+	// runtime earns it among the fair ones.  If nothing else is
+	// runnable it is picked again, so no other CPU is woken for it.
+	if (curenv) {
+		env_lock(curenv);
+		if (curenv->env_status == ENV_RUNNING) {
+			curenv->env_status = ENV_RUNNABLE;
+			runq_push(curenv);
+		}
+		env_unlock(curenv);
+	}
+
+	while ((e = runq_pop(&runqueues[thiscpu->cpu_id])) || (e = runq_steal())) {
+		env_lock(e);
+		if (e->env_status == ENV_RUNNABLE &&
+		    (e->env_cpunum < 0 || e == curenv)) {
+			e->env_slice = 0;
+			sched_timer_arm(e);
+			env_run(e); // releases e's lock
+		}
+		// An env made runnable again before the CPU that last ran
+		// it has switched away.  Set it aside and queue it again
+		// below; each other CPU holds at most one env.
+		if (e->env_status == ENV_RUNNABLE) {
+			if (nbusy == NCPU) {
+				sched_enqueue(e);
+				env_unlock(e);
+				break;
+			}
+			busy[nbusy++] = e;
+		}
+		env_unlock(e);
+	}
+	for (i = 0; i < nbusy; i++) {
+		env_lock(busy[i]);
+		if (busy[i]->env_status == ENV_RUNNABLE)
+			sched_enqueue(busy[i]);
+		env_unlock(busy[i]);
+	}
+
 	// sched_halt never returns
 	sched_halt();
 }
 
-// Halt this CPU when there is nothing to do. Wait until the
-// timer interrupt wakes it up. This function never returns.
+// Called on every timer interrupt.  Preempt the env running on this
+// CPU once its time slice is used up, and otherwise set the timer for
+// the next deadline.
+void
+sched_tick(void)
+{
+	sched_charge();
+	if (curenv && curenv->env_status == ENV_RUNNING &&
+	    curenv->env_slice >= sched_slice_us(curenv))
+		sched_yield();
+	sched_timer_arm(curenv && curenv->env_status == ENV_RUNNING ? curenv : NULL);
+}
+
+// Halt this CPU when there is nothing to do. Wait until a timer
+// interrupt, or another CPU with new work, wakes it up. This
+// function never returns.
 //
 void
 sched_halt(void)
 {
 	int i;
+	struct Env *prev;
 	bool runnable_exists = false;
 	bool only_not_runnable_exists = true;
 
@@ -81,27 +391,54 @@ sched_halt(void)
 			monitor(NULL);
 	}
 
-	// Mark that no environment is running on this CPU
-	curenv = NULL;
-	lcr3(PADDR(kern_pgdir));
-
-	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
-	xchg(&thiscpu->cpu_status, CPU_HALTED);
+	// Mark that no environment is running on this CPU, and hand
+	// the last one back now that its page directory is unloaded.
+	if ((prev = curenv)) {
+		lcr3(PADDR(kern_pgdir));
+		curenv = NULL;
+		env_release(prev);
+	}
 
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
+	sched_timer_arm(NULL);
 
-	// Reset stack pointer, enable interrupts and then halt.
+	// Reset stack pointer and wait in sched_idle.
 	asm volatile("movl $0, %%ebp\n"
 		     "movl %0, %%esp\n"
 		     "pushl $0\n"
 		     "pushl $0\n"
-		     "sti\n"
-		     "1:\n"
-		     "hlt\n"
-		     "jmp 1b\n"
+		     "call sched_idle\n"
 		     :
 		     : "a"(thiscpu->cpu_ts.ts_esp0));
+	panic("sched_halt: sched_idle returned");
+}
+
+// The end of sched_halt, on a fresh stack.  Halt until an interrupt,
+// unless work was queued after sched_yield last looked.
+void __attribute__((noreturn, used))
+sched_idle(void)
+{
+	int i;
+
+	// Zero free pages for page_alloc(ALLOC_ZERO) until there is work.
+	do {
+		for (i = 0; i < ncpu && !runqueues[i].rq_len; i++)
+			;
+	} while (i == ncpu && page_zero_idle());
+
+	// Mark that this CPU is in the HALT state.  A waker queues
+	// work and then looks for a halted CPU (see sched_wake); this
+	// CPU marks itself halted and then looks for work.  Both order
+	// the two steps, so at least one of them sees the other.
+	xchg(&thiscpu->cpu_status, CPU_HALTED);
+	for (i = 0; i < ncpu; i++)
+		if (runqueues[i].rq_len > 0 &&
+		    cmpxchg(&thiscpu->cpu_status, CPU_HALTED, CPU_STARTED) == CPU_HALTED)
+			sched_yield();
+
+	// Enable interrupts and then halt.
+	asm volatile("sti\n"
+		     "1:\n"
+		     "hlt\n"
+		     "jmp 1b\n");
+	panic("sched_idle: hlt loop exited");
 }
@@ -6,6 +6,24 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+struct Env;
+
+// Scheduler tick length.  Time slices are counted in ticks; a CPU
+// takes a timer interrupt only when a time slice runs out.
+#define SCHED_TICK_US 10000
+
+// Default time slice in ticks.
+// Override at build time with -DSCHED_QUANTUM=n.
+#ifndef SCHED_QUANTUM
+#define SCHED_QUANTUM 5
+#endif
+
+extern unsigned sched_quantum;
+
+void sched_init(void);
+void sched_enqueue(struct Env *e);
+void sched_tick(void);
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
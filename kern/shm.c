@@ -0,0 +1,186 @@
+// Named shared-memory segments.
+//
+// A segment is a set of zeroed pages that envs map by name, all at
+// once, so that they can pass bulk data without a system call or a
+// copy per page.  The segment holds one reference on each of its pages
+// (pp_ref) and every mapping another, so unlinking a segment only
+// drops the name: its pages are freed when the last env unmaps them.
+//
+// Lock order: env locks, then shm_lock, then page_lock.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/spinlock.h>
+#include <kern/vma.h>
+#include <kern/shm.h>
+
+#define NSHM 64
+
+struct ShmSeg {
+	char shm_name[SHM_NAMELEN];	// Empty if the slot is free
+	size_t shm_npages;
+	struct PageInfo **shm_pages;	// One per page of the segment
+};
+
+static struct ShmSeg shm_segs[NSHM];
+static struct spinlock shm_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "shm_lock"
+#endif
+};
+
+static struct ShmSeg *
+shm_lookup(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NSHM; i++)
+		if (shm_segs[i].shm_name[0] &&
+		    strcmp(shm_segs[i].shm_name, name) == 0)
+			return &shm_segs[i];
+	return NULL;
+}
+
+// Drop the segment's own references on its pages and free its page
+// array.
+static void
+shm_free_pages(struct PageInfo **pages, size_t npages)
+{
+	size_t i;
+
+	for (i = 0; i < npages && pages[i]; i++)
+		page_decref(pages[i]);
+	page_free(pa2page(PADDR(pages)));
+}
+
+//
+// Create a segment of len bytes (rounded up to pages), all zero,
+// called 'name'.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if len is 0 or more than SHM_MAXSIZE
+//   -E_FILE_EXISTS, if there is a segment called 'name' already
+//   -E_NO_MEM, if there is no memory for the segment or no free slot
+//
+int
+shm_create(const char *name, size_t len)
+{
+	struct PageInfo *pp, **pages;
+	struct ShmSeg *seg;
+	size_t npages, i;
+	unsigned order;
+
+	if (!len || len > SHM_MAXSIZE)
+		return -E_INVAL;
+	npages = ROUNDUP(len, PGSIZE) / PGSIZE;
+
+	// The page array is a block of its own, found with its order.
+	for (order = 0; (PGSIZE << order) < npages * sizeof(*pages); order++)
+		;
+	if (!(pp = page_alloc_order(order, ALLOC_ZERO)))
+		return -E_NO_MEM;
+	pages = page2kva(pp);
+	for (i = 0; i < npages; i++) {
+		if (!(pages[i] = page_alloc(ALLOC_ZERO))) {
+			shm_free_pages(pages, npages);
+			return -E_NO_MEM;
+		}
+		page_incref(pages[i]);
+	}
+
+	spin_lock(&shm_lock);
+	if (shm_lookup(name)) {
+		spin_unlock(&shm_lock);
+		shm_free_pages(pages, npages);
+		return -E_FILE_EXISTS;
+	}
+	for (seg = shm_segs; seg < shm_segs + NSHM && seg->shm_name[0]; seg++)
+		;
+	if (seg == shm_segs + NSHM) {
+		spin_unlock(&shm_lock);
+		shm_free_pages(pages, npages);
+		return -E_NO_MEM;
+	}
+	strcpy(seg->shm_name, name);
+	seg->shm_npages = npages;
+	seg->shm_pages = pages;
+	spin_unlock(&shm_lock);
+	return 0;
+}
+
+//
+// Map all of segment 'name' at 'va' in e, with permissions 'perm'.
+// The mappings are PTE_SHARE, so that e's children share them too.
+// Whatever was mapped in the range is unmapped, even if the attach then
+// fails.  The caller holds e's lock.
+//
+// RETURNS:
+//   the size of the segment in bytes, on success
+//   -E_NOT_FOUND, if there is no segment called 'name'
+//   -E_INVAL, if the segment does not fit below UTOP at va
+//   -E_NO_MEM, if there is no memory for page tables
+//
+int
+shm_attach(struct Env *e, const char *name, void *va, int perm)
+{
+	struct ShmSeg *seg;
+	size_t i, len;
+	int r = 0;
+
+	spin_lock(&shm_lock);
+	if (!(seg = shm_lookup(name))) {
+		spin_unlock(&shm_lock);
+		return -E_NOT_FOUND;
+	}
+	len = seg->shm_npages * PGSIZE;
+	if ((uintptr_t)va > UTOP - len) {
+		spin_unlock(&shm_lock);
+		return -E_INVAL;
+	}
+	vma_unmap(e, (uintptr_t)va, (uintptr_t)va + len);
+	if ((r = vma_add(e, (uintptr_t)va, (uintptr_t)va + len)) == 0)
+		for (i = 0; i < seg->shm_npages; i++)
+			if ((r = page_insert(e->env_pgdir, seg->shm_pages[i],
+					     va + i * PGSIZE,
+					     perm | PTE_SHARE)) < 0)
+				break;
+	spin_unlock(&shm_lock);
+
+	if (r < 0) {
+		vma_unmap(e, (uintptr_t)va, (uintptr_t)va + len);
+		return r;
+	}
+	return len;
+}
+
+//
+// Remove the name 'name'.  Envs that have the segment mapped keep it.
+//
+// RETURNS:
+//   0 on success
+//   -E_NOT_FOUND, if there is no segment called 'name'
+//
+int
+shm_unlink(const char *name)
+{
+	struct ShmSeg *seg;
+	struct PageInfo **pages;
+	size_t npages;
+
+	spin_lock(&shm_lock);
+	if (!(seg = shm_lookup(name))) {
+		spin_unlock(&shm_lock);
+		return -E_NOT_FOUND;
+	}
+	pages = seg->shm_pages;
+	npages = seg->shm_npages;
+	seg->shm_name[0] = '\0';
+	spin_unlock(&shm_lock);
+
+	shm_free_pages(pages, npages);
+	return 0;
+}
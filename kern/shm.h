@@ -0,0 +1,16 @@
+#ifndef JOS_KERN_SHM_H
+#define JOS_KERN_SHM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/shm.h>
+
+struct Env;
+
+int shm_create(const char *name, size_t len);
+int shm_attach(struct Env *e, const char *name, void *va, int perm);
+int shm_unlink(const char *name);
+
+#endif	// !JOS_KERN_SHM_H
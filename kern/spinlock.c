@@ -9,31 +9,40 @@
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
 
-// The big kernel lock
-struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
-	.name = "kernel_lock"
-#endif
-};
+// Spin-loop tuning.  A ticket waiter first pauses BACKOFF_UNIT times
+// for each CPU ahead of it, then doubles the delay (up to BACKOFF_MAX)
+// each time it finds the lock has not moved on.
+#define BACKOFF_UNIT	32
+#define BACKOFF_MAX	4096
 
-#ifdef DEBUG_SPINLOCK
-// Record the current call stack in pcs[] by following the %ebp chain.
-static void
-get_caller_pcs(uint32_t pcs[])
+// MCS queue nodes, per CPU.  A CPU needs one for each MCS lock it
+// holds or waits for at once.
+#define MCS_NODES	8
+static struct mcs_node mcs_nodes[NCPU][MCS_NODES];
+
+#if defined(DEBUG_SPINLOCK) || defined(LOCKSTAT)
+// Record the call stack of our caller's caller (the code that called
+// spin_lock) in pcs[] by following the %ebp chain.
+static void __attribute__((noinline))
+get_caller_pcs(uint32_t pcs[], int n)
 {
 	uint32_t *ebp;
 	int i;
 
 	ebp = (uint32_t *)read_ebp();
-	for (i = 0; i < 10; i++){
+	ebp = (uint32_t *)ebp[0]; // skip our own frame
+	for (i = 0; i < n; i++){
 		if (ebp == 0 || ebp < (uint32_t *)ULIM)
 			break;
 		pcs[i] = ebp[1];          // saved %eip
 		ebp = (uint32_t *)ebp[0]; // saved %ebp
 	}
-	for (; i < 10; i++)
+	for (; i < n; i++)
 		pcs[i] = 0;
 }
+#endif
+
+#ifdef DEBUG_SPINLOCK
 
 // Check whether this CPU is holding the lock.
 static int
@@ -46,6 +55,9 @@ holding(struct spinlock *lock)
 void
 __spin_initlock(struct spinlock *lk, char *name)
 {
+	lk->next = lk->owner = 0;
+	lk->tail = lk->node = 0;
+	lk->mcs = 0;
 	lk->locked = 0;
 #ifdef DEBUG_SPINLOCK
 	lk->name = name;
@@ -53,6 +65,246 @@ __spin_initlock(struct spinlock *lk, char *name)
 #endif
 }
 
+void
+__spin_initlock_mcs(struct spinlock *lk, char *name)
+{
+	__spin_initlock(lk, name);
+	lk->mcs = 1;
+}
+
+static inline void
+spin_delay(uint32_t n)
+{
+	while (n-- > 0)
+		asm volatile("pause");
+}
+
+// Returns whether the lock was busy.
+static bool
+ticket_lock(struct spinlock *lk)
+{
+	uint32_t me, owner, delay;
+
+	// The xadd is atomic.
+	// It also serializes, so that reads after acquire are not
+	// reordered before it.
+	me = xadd(&lk->next, 1);
+	owner = lk->owner;
+	if (owner == me)
+		return false;
+	delay = (me - owner) * BACKOFF_UNIT;
+	while (owner != me) {
+		spin_delay(delay);
+		if (lk->owner == owner && delay < BACKOFF_MAX)
+			delay *= 2;
+		else if (lk->owner != owner)
+			delay = (me - lk->owner) * BACKOFF_UNIT;
+		owner = lk->owner;
+	}
+	return true;
+}
+
+static void
+ticket_unlock(struct spinlock *lk)
+{
+	// Only the holder writes owner, and x86 does not move earlier
+	// loads or stores after a store, so a plain store releases the
+	// lock.  The barrier keeps gcc from doing so either.
+	asm volatile("" ::: "memory");
+	lk->owner = lk->owner + 1;
+}
+
+static struct mcs_node *
+mcs_node_get(void)
+{
+	struct mcs_node *n = mcs_nodes[thiscpu->cpu_id];
+	int i;
+
+	for (i = 0; i < MCS_NODES; i++)
+		if (!n[i].busy) {
+			n[i].busy = 1;
+			return &n[i];
+		}
+	panic("CPU %d holds too many MCS locks", cpunum());
+}
+
+// Returns whether the lock was busy.
+static bool
+mcs_lock(struct spinlock *lk)
+{
+	struct mcs_node *node, *prev;
+
+	node = mcs_node_get();
+	node->next = 0;
+	node->waiting = 1;
+	prev = (struct mcs_node *)xchg((volatile uint32_t *)&lk->tail, (uint32_t)node);
+	if (prev) {
+		prev->next = node;
+		while (node->waiting)
+			asm volatile("pause");
+	}
+	lk->node = node;
+	return prev != 0;
+}
+
+static void
+mcs_unlock(struct spinlock *lk)
+{
+	struct mcs_node *node = lk->node;
+
+	if (!node->next) {
+		// No known successor: try to swing the tail back to empty.
+		if (cmpxchg((volatile uint32_t *)&lk->tail, (uint32_t)node, 0) == (uint32_t)node)
+			goto done;
+		// A waiter is enqueueing itself; wait for it to link in.
+		while (!node->next)
+			asm volatile("pause");
+	}
+	node->next->waiting = 0;
+done:
+	node->busy = 0;
+}
+
+#ifdef LOCKSTAT
+// All locks that have been acquired at least once, linked through
+// stat.ls_next.  Locks are added lock-free and never removed.
+static struct spinlock *volatile lockstat_locks;
+
+static void
+lockstat_register(struct spinlock *lk)
+{
+	struct spinlock *head;
+
+	lk->stat.ls_registered = 1;
+	do {
+		head = lockstat_locks;
+		lk->stat.ls_next = head;
+	} while (cmpxchg((volatile uint32_t *)&lockstat_locks, (uint32_t)head, (uint32_t)lk) !=
+		 (uint32_t)head);
+}
+
+// Account for an acquisition of 'lk', which this CPU now holds.
+// 'start' is when it began trying; if it had to wait, pcs[] is the
+// call site, as recorded by spin_lock.
+static void
+lockstat_acquired(struct spinlock *lk, bool contended, uint64_t start,
+		  uint32_t pcs[2])
+{
+	struct lockstat *ls = &lk->stat;
+	int i, min;
+
+	if (!ls->ls_registered)
+		lockstat_register(lk);
+	ls->ls_hold_start = read_tsc();
+	ls->ls_acquired++;
+	if (!contended)
+		return;
+	ls->ls_contended++;
+	ls->ls_spin += ls->ls_hold_start - start;
+
+	// Count the call site.  When the table is full, the least
+	// frequent site makes room and the newcomer inherits its count,
+	// so frequent sites are never undercounted.
+	for (i = 0, min = 0; i < LOCKSTAT_SITES; i++) {
+		if (ls->ls_sites[i].pcs[0] == pcs[0] && ls->ls_sites[i].pcs[1] == pcs[1]) {
+			ls->ls_sites[i].count++;
+			return;
+		}
+		if (ls->ls_sites[i].count < ls->ls_sites[min].count)
+			min = i;
+	}
+	ls->ls_sites[min].pcs[0] = pcs[0];
+	ls->ls_sites[min].pcs[1] = pcs[1];
+	ls->ls_sites[min].count++;
+}
+
+static const char *
+lock_name(struct spinlock *lk)
+{
+#ifdef DEBUG_SPINLOCK
+	if (lk->name)
+		return lk->name;
+#endif
+	return "?";
+}
+
+static void
+print_site(uintptr_t pc)
+{
+	struct Eipdebuginfo info;
+
+	if (pc && debuginfo_eip(pc, &info) >= 0)
+		cprintf("%.*s+%x", info.eip_fn_namelen, info.eip_fn_name,
+			pc - info.eip_fn_addr);
+	else
+		cprintf("%08x", pc);
+}
+
+// Print the statistics of every lock that has been used.  Locks of
+// the same name (such as the per-env locks) are shown once each, with
+// the statistics summed and the busiest one's call sites.
+void
+lockstat_print(void)
+{
+	struct spinlock *lk, *other, *busiest;
+	struct lockstat sum;
+	int i;
+
+	cprintf("%-14s %10s %10s %12s %12s\n",
+		"lock", "acquired", "contended", "spin-cycles", "max-hold");
+	for (lk = lockstat_locks; lk; lk = lk->stat.ls_next) {
+		// Skip names already printed
+		for (other = lockstat_locks; other != lk; other = other->stat.ls_next)
+			if (strcmp(lock_name(other), lock_name(lk)) == 0)
+				break;
+		if (other != lk)
+			continue;
+
+		memset(&sum, 0, sizeof(sum));
+		busiest = lk;
+		for (other = lk; other; other = other->stat.ls_next) {
+			if (strcmp(lock_name(other), lock_name(lk)) != 0)
+				continue;
+			sum.ls_acquired += other->stat.ls_acquired;
+			sum.ls_contended += other->stat.ls_contended;
+			sum.ls_spin += other->stat.ls_spin;
+			if (other->stat.ls_max_hold > sum.ls_max_hold)
+				sum.ls_max_hold = other->stat.ls_max_hold;
+			if (other->stat.ls_contended > busiest->stat.ls_contended)
+				busiest = other;
+		}
+		if (!sum.ls_acquired)
+			continue;
+		cprintf("%-14s %10llu %10llu %12llu %12llu\n", lock_name(lk),
+			sum.ls_acquired, sum.ls_contended, sum.ls_spin, sum.ls_max_hold);
+		for (i = 0; i < LOCKSTAT_SITES; i++) {
+			if (!busiest->stat.ls_sites[i].count)
+				continue;
+			cprintf("    %8u  ", busiest->stat.ls_sites[i].count);
+			print_site(busiest->stat.ls_sites[i].pcs[0]);
+			cprintf(" <- ");
+			print_site(busiest->stat.ls_sites[i].pcs[1]);
+			cprintf("\n");
+		}
+	}
+}
+
+// Clear the statistics of every lock.
+void
+lockstat_reset(void)
+{
+	struct spinlock *lk;
+
+	for (lk = lockstat_locks; lk; lk = lk->stat.ls_next) {
+		lk->stat.ls_acquired = 0;
+		lk->stat.ls_contended = 0;
+		lk->stat.ls_spin = 0;
+		lk->stat.ls_max_hold = 0;
+		memset(lk->stat.ls_sites, 0, sizeof(lk->stat.ls_sites));
+	}
+}
+#endif
+
 // Acquire the lock.
 // Loops (spins) until the lock is acquired.
 // Holding a lock for a long time may cause
@@ -65,16 +317,30 @@ spin_lock(struct spinlock *lk)
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
 #endif
 
-	// The xchg is atomic.
-	// It also serializes, so that reads after acquire are not
-	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile ("pause");
+#ifdef LOCKSTAT
+	uint64_t start = read_tsc();
+	uint32_t pcs[2];
+#endif
+	bool contended;
+
+	if (lk->mcs)
+		contended = mcs_lock(lk);
+	else
+		contended = ticket_lock(lk);
+	lk->locked = 1;
+
+#ifdef LOCKSTAT
+	// get_caller_pcs must run in spin_lock's own frame to find
+	// the caller.
+	if (contended)
+		get_caller_pcs(pcs, 2);
+	lockstat_acquired(lk, contended, start, pcs);
+#endif
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
 	lk->cpu = thiscpu;
-	get_caller_pcs(lk->pcs);
+	get_caller_pcs(lk->pcs, 10);
 #endif
 }
 
@@ -107,14 +373,15 @@ spin_unlock(struct spinlock *lk)
 	lk->cpu = 0;
 #endif
 
-	// The xchg serializes, so that reads before release are 
-	// not reordered after it.  The 1996 PentiumPro manual (Volume 3,
-	// 7.2) says reads can be carried out speculatively and in
-	// any order, which implies we need to serialize here.
-	// But the 2007 Intel 64 Architecture Memory Ordering White
-	// Paper says that Intel 64 and IA-32 will not move a load
-	// after a store. So lock->locked = 0 would work here.
-	// The xchg being asm volatile ensures gcc emits it after
-	// the above assignments (and after the critical section).
-	xchg(&lk->locked, 0);
+#ifdef LOCKSTAT
+	uint64_t held = read_tsc() - lk->stat.ls_hold_start;
+	if (held > lk->stat.ls_max_hold)
+		lk->stat.ls_max_hold = held;
+#endif
+
+	lk->locked = 0;
+	if (lk->mcs)
+		mcs_unlock(lk);
+	else
+		ticket_unlock(lk);
 }
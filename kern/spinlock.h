@@ -6,10 +6,57 @@
 // Comment this to disable spinlock debugging
 #define DEBUG_SPINLOCK
 
+// Comment this to disable lock contention statistics
+#define LOCKSTAT
+
+#ifdef LOCKSTAT
+#define LOCKSTAT_SITES 4
+
+// Per-lock contention statistics.  Updated by the holder, so they
+// need no synchronization of their own.  Times are in TSC cycles.
+struct lockstat {
+	uint64_t ls_acquired;	   // Acquisitions
+	uint64_t ls_contended;	   // Acquisitions that had to wait
+	uint64_t ls_spin;	   // Total cycles spent waiting
+	uint64_t ls_max_hold;	   // Longest time held
+	uint64_t ls_hold_start;	   // When the current holder got it
+	struct {
+		uintptr_t pcs[2];  // Contending call site and its caller
+		uint32_t count;
+	} ls_sites[LOCKSTAT_SITES]; // Most frequent contending sites
+	struct spinlock *ls_next;  // Next lock in the lockstat registry
+	bool ls_registered;
+};
+#endif
+
+// A waiter's place in an MCS lock queue.  Each CPU has a few of
+// these, one per lock it may hold or wait for at the same time.
+struct mcs_node {
+	struct mcs_node *volatile next; // Next waiter in the queue
+	volatile uint32_t waiting;	// Cleared by the previous holder
+	bool busy;			// In use by this CPU
+};
+
 // Mutual exclusion lock.
+//
+// By default this is a ticket lock: CPUs take a ticket with one
+// atomic add and spin until it is served, so the lock is granted in
+// FIFO order.  A lock initialized with spin_initlock_mcs, or with
+// .mcs = 1, is an MCS queue lock instead: each waiter spins on its
+// own mcs_node, so a handoff touches one other CPU's cache line no
+// matter how many CPUs wait.
 struct spinlock {
+	volatile uint32_t next;		// Ticket lock: next ticket to hand out
+	volatile uint32_t owner;	// Ticket lock: ticket being served
+	struct mcs_node *volatile tail; // MCS lock: last waiter, or NULL
+	struct mcs_node *node;		// MCS lock: the holder's node
+	bool mcs;			// Use the MCS protocol
 	unsigned locked;       // Is the lock held?
 
+#ifdef LOCKSTAT
+	struct lockstat stat;
+#endif
+
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
 	char *name;            // Name of lock.
@@ -20,29 +67,14 @@ struct spinlock {
 };
 
 void __spin_initlock(struct spinlock *lk, char *name);
+void __spin_initlock_mcs(struct spinlock *lk, char *name);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
 
-#define spin_initlock(lock)   __spin_initlock(lock, #lock)
+void lockstat_print(void);
+void lockstat_reset(void);
 
-extern struct spinlock kernel_lock;
-
-static inline void
-lock_kernel(void)
-{
-	spin_lock(&kernel_lock);
-}
-
-static inline void
-unlock_kernel(void)
-{
-	spin_unlock(&kernel_lock);
-
-	// Normally we wouldn't need to do this, but QEMU only runs
-	// one CPU at a time and has a long time-slice.  Without the
-	// pause, this CPU is likely to reacquire the lock before
-	// another CPU has even been given a chance to acquire it.
-	asm volatile("pause");
-}
+#define spin_initlock(lock)   __spin_initlock(lock, #lock)
+#define spin_initlock_mcs(lock)   __spin_initlock_mcs(lock, #lock)
 
 #endif
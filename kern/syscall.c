@@ -13,6 +13,8 @@
 #include <kern/sched.h>
 #include <kern/time.h>
 #include <kern/e1000.h>
+#include <kern/vma.h>
+#include <kern/shm.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -55,7 +57,7 @@ sys_env_destroy(envid_t envid)
 	int r;
 	struct Env *e;
 
-	if ((r = envid2env(envid, &e, 1)) < 0)
+	if ((r = envid2env_lock(envid, &e, 1)) < 0)
 		return r;
 	env_destroy(e);
 	return 0;
@@ -83,16 +85,24 @@ sys_exofork(void)
 
 	// LAB 4: Your code here.
 	struct Env *new_env;
-	int err = env_alloc(&new_env, curenv->env_id);
+	int err = env_dup(&new_env, curenv);
 	if (err < 0)
 		return err;
 
-	new_env->env_status = ENV_NOT_RUNNABLE;
-	new_env->env_tf = curenv->env_tf;
-	new_env->env_tf.tf_regs.reg_eax = 0;
 	return new_env->env_id;
 }
 
+// Fork the current environment in one go: the child gets a
+// copy-on-write view of everything below USTACKTOP, a fresh exception
+// stack and our page fault upcall, and is already runnable.
+//
+// Returns the child's envid, < 0 on error (see env_fork).
+static envid_t
+sys_fork(void)
+{
+	return env_fork(curenv);
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -116,10 +126,18 @@ sys_env_set_status(envid_t envid, int status)
 	if (status != ENV_RUNNABLE && status != ENV_NOT_RUNNABLE)
 		return -E_INVAL;
 
-	if ((err = envid2env(envid, &env, true)) < 0)
+	if ((err = envid2env_lock(envid, &env, true)) < 0)
 		return err;
 
-	env->env_status = status;
+	// An env already running on some CPU must not be queued again,
+	// and a dying one must not come back.
+	if (env->env_status != ENV_DYING &&
+	    (env->env_status != ENV_RUNNING || status != ENV_RUNNABLE)) {
+		env->env_status = status;
+		if (status == ENV_RUNNABLE)
+			sched_enqueue(env);
+	}
+	env_unlock(env);
 
 	return 0;
 }
@@ -140,11 +158,12 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	struct Env *env;
 	int err;
 
-	if ((err = envid2env(envid, &env, true)) < 0)
+	user_mem_assert(curenv, tf, sizeof(struct Trapframe), PTE_U | PTE_P | PTE_W);
+	if ((err = envid2env_lock(envid, &env, true)) < 0)
 		return err;
-	user_mem_assert(env, tf, sizeof(struct Env), PTE_U | PTE_P | PTE_W);
 	tf->tf_eflags |= FL_IF;
 	memcpy(&env->env_tf, tf, sizeof(struct Trapframe));
+	env_unlock(env);
 	return 0;
 }
 
@@ -163,9 +182,55 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 	struct Env *env;
 	int err;
 
-	if ((err = envid2env(envid, &env, true)) < 0)
+	if ((err = envid2env_lock(envid, &env, true)) < 0)
 		return -E_BAD_ENV;
 	env->env_pgfault_upcall = func;
+	env_unlock(env);
+
+	return 0;
+}
+
+// Set the time slice of 'envid' to 'ticks' timer ticks.  When the env
+// has run for that long it is preempted and goes to the back of the
+// run queue.  A 'ticks' of 0 selects the system default, sched_quantum.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+static int
+sys_env_set_quantum(envid_t envid, uint32_t ticks)
+{
+	struct Env *env;
+	int err;
+
+	if ((err = envid2env_lock(envid, &env, true)) < 0)
+		return err;
+	env->env_quantum = ticks;
+	env_unlock(env);
+
+	return 0;
+}
+
+// Set the priority of 'envid', from ENV_PRIO_MIN (most CPU time) to
+// ENV_PRIO_MAX (least).  Among runnable fair-class envs, each level
+// is worth about 1.25 times the CPU time of the level below it.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if priority is out of range.
+static int
+sys_env_set_priority(envid_t envid, int priority)
+{
+	struct Env *env;
+	int err;
+
+	if (priority < ENV_PRIO_MIN || priority > ENV_PRIO_MAX)
+		return -E_INVAL;
+	if ((err = envid2env_lock(envid, &env, true)) < 0)
+		return err;
+	env->env_priority = priority;
+	env_unlock(env);
 
 	return 0;
 }
@@ -178,12 +243,16 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 //
 // perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
 //         but no other bits may be set.  See PTE_SYSCALL in inc/mmu.h.
+//         PTE_PS may be added to get a 4MB superpage at 4MB-aligned 'va',
+//         replacing everything mapped in that 4MB.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
 //	-E_INVAL if perm is inappropriate (see above).
+//	-E_INVAL if perm has PTE_PS but va is not 4MB-aligned, or the
+//		CPU has no 4MB pages.
 //	-E_NO_MEM if there's no memory to allocate the new page,
 //		or to allocate any necessary page tables.
 static int
@@ -206,18 +275,29 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 
 	if (va >= (void *)UTOP || va != ROUNDDOWN(va, PGSIZE))
 		return -E_INVAL;
-	if (perm & ~PTE_SYSCALL)
+	if (perm & ~(PTE_SYSCALL | PTE_PS))
+		return -E_INVAL;
+	if ((perm & PTE_PS) && (!pse_enabled || SPGOFF(va)))
 		return -E_INVAL;
 
 	struct PageInfo *page;
-	page = page_alloc(ALLOC_ZERO);
+	if (perm & PTE_PS)
+		page = page_alloc_order(SP_ORDER, ALLOC_ZERO);
+	else
+		page = page_alloc(ALLOC_ZERO);
 	if (!page)
 		return -E_NO_MEM;
 
-	if (page_insert(env->env_pgdir, page, va, perm | PTE_U) < 0) {
+	if ((err = envid2env_lock(envid, &env, true)) < 0) {
+		page_free(page);
+		return err;
+	}
+	if (vma_page_insert(env, page, va, (perm & ~PTE_PS) | PTE_U) < 0) {
+		env_unlock(env);
 		page_free(page);
 		return -E_NO_MEM;
 	}
+	env_unlock(env);
 	return 0;
 }
 
@@ -236,6 +316,8 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
+//	-E_INVAL if srcva is in a superpage, and srcva or dstva is not
+//		4MB-aligned.  Superpages are only mapped as a whole.
 //	-E_NO_MEM if there's no memory to allocate any necessary page tables.
 static int
 sys_page_map(envid_t srcenvid, void *srcva, envid_t dstenvid, void *dstva, int perm)
@@ -262,16 +344,22 @@ sys_page_map(envid_t srcenvid, void *srcva, envid_t dstenvid, void *dstva, int p
 
 	struct PageInfo *psrc, *pdst;
 	pte_t *src_pte, *dst_pte;
-
-	if (!(psrc = page_lookup(src->env_pgdir, srcva, &src_pte)))
-		return -E_INVAL;
-	if ((perm & PTE_W) && !(*src_pte & PTE_W))
-		return -E_INVAL;
-
-	if (page_insert(dst->env_pgdir, psrc, dstva, perm | PTE_U) < 0)
-		return -E_NO_MEM;
-
-	return 0;
+	int r = 0;
+
+	env_lock_pair(src, dst);
+	if (!env_is(src, srcenvid) || !env_is(dst, dstenvid))
+		r = -E_BAD_ENV;
+	else if (!(psrc = page_lookup(src->env_pgdir, srcva, &src_pte)))
+		r = -E_INVAL;
+	else if ((perm & PTE_W) && !(*src_pte & PTE_W))
+		r = -E_INVAL;
+	else if ((*src_pte & PTE_PS) && SPGOFF(srcva))
+		r = -E_INVAL;
+	else
+		r = vma_page_insert(dst, psrc, dstva, perm | PTE_U);
+	env_unlock_pair(src, dst);
+
+	return r;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
@@ -292,13 +380,168 @@ sys_page_unmap(envid_t envid, void *va)
 		return -E_BAD_ENV;
 	if (va >= (void *)UTOP || va != ROUNDDOWN(va, PGSIZE))
 		return -E_INVAL;
-	page_remove(env->env_pgdir, va);
+	if (envid2env_lock(envid, &env, true) < 0)
+		return -E_BAD_ENV;
+	vma_page_remove(env, va);
+	env_unlock(env);
 	return 0;
 }
 
+// Reserve [va, va+len) in the address space of 'envid' as demand-zero
+// memory with permission 'perm'.  Nothing is allocated now: the first
+// read of a page maps a shared page of zeros, and the first write a
+// private zeroed page.  Whatever was mapped in the range is unmapped.
+//
+// perm -- as in sys_page_alloc, except that PTE_PS is not allowed.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not page-aligned, len is 0, or the range
+//		reaches above UTOP.
+//	-E_INVAL if perm is inappropriate (see above).
+//	-E_NO_MEM if there's no memory to record the reservation.
+static int
+sys_mmap(envid_t envid, void *va, size_t len, int perm)
+{
+	struct Env *env;
+	int r;
+
+	if ((r = envid2env(envid, &env, true)) < 0)
+		return r;
+	len = ROUNDUP(len, PGSIZE);
+	if (va != ROUNDDOWN(va, PGSIZE) || !len || len > UTOP ||
+	    (uintptr_t)va > UTOP - len)
+		return -E_INVAL;
+	if (perm & ~PTE_SYSCALL)
+		return -E_INVAL;
+
+	if ((r = envid2env_lock(envid, &env, true)) < 0)
+		return r;
+	r = vma_map(env, (uintptr_t)va, (uintptr_t)va + len,
+		    perm | PTE_U | PTE_P);
+	env_unlock(env);
+	return r;
+}
+
+// Copy the segment name at 'uname' in user space into 'name', which has
+// room for SHM_NAMELEN bytes.  Destroys the environment on memory errors.
+// Returns 0, or -E_INVAL if the name is empty or too long.
+static int
+shm_copy_name(char *name, const char *uname)
+{
+	int i;
+
+	for (i = 0; i < SHM_NAMELEN; i++) {
+		if (i == 0 || (uintptr_t)(uname + i) % PGSIZE == 0)
+			user_mem_assert(curenv, uname + i, 1, PTE_U);
+		if (!(name[i] = uname[i]))
+			return i ? 0 : -E_INVAL;
+	}
+	return -E_INVAL;
+}
+
+// Create a shared-memory segment of 'len' bytes, rounded up to pages
+// and zeroed, called 'name'.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if name is empty or longer than SHM_NAMELEN - 1,
+//		or len is 0 or more than SHM_MAXSIZE.
+//	-E_FILE_EXISTS if there is a segment called 'name' already.
+//	-E_NO_MEM if there's no memory for the segment.
+static int
+sys_shm_create(const char *uname, size_t len)
+{
+	char name[SHM_NAMELEN];
+	int r;
+
+	if ((r = shm_copy_name(name, uname)) < 0)
+		return r;
+	return shm_create(name, len);
+}
+
+// Map all of segment 'name' at 'va' in the address space of 'envid',
+// with permission 'perm', as in sys_page_map.  Children inherit the
+// mapping shared (PTE_SHARE).  Whatever was mapped in the range is
+// unmapped, as in sys_mmap.
+//
+// Returns the size of the segment in bytes, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if name is invalid, va is not page-aligned, or the
+//		segment does not fit below UTOP at va.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_NOT_FOUND if there is no segment called 'name'.
+//	-E_NO_MEM if there's no memory to allocate any necessary page tables.
+static int
+sys_shm_attach(envid_t envid, const char *uname, void *va, int perm)
+{
+	char name[SHM_NAMELEN];
+	struct Env *env;
+	int r;
+
+	if ((r = shm_copy_name(name, uname)) < 0)
+		return r;
+	if (va >= (void *)UTOP || va != ROUNDDOWN(va, PGSIZE))
+		return -E_INVAL;
+	if (perm & ~PTE_SYSCALL)
+		return -E_INVAL;
+	if ((r = envid2env_lock(envid, &env, true)) < 0)
+		return r;
+	r = shm_attach(env, name, va, perm | PTE_U | PTE_P);
+	env_unlock(env);
+	return r;
+}
+
+// Unmap the 'len' bytes at 'va' in the address space of 'envid', as
+// returned by sys_shm_attach.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not page-aligned or the range reaches above UTOP.
+static int
+sys_shm_detach(envid_t envid, void *va, size_t len)
+{
+	struct Env *env;
+	int r;
+
+	len = ROUNDUP(len, PGSIZE);
+	if (va != ROUNDDOWN(va, PGSIZE) || len > UTOP ||
+	    (uintptr_t)va > UTOP - len)
+		return -E_INVAL;
+	if ((r = envid2env_lock(envid, &env, true)) < 0)
+		return r;
+	vma_unmap(env, (uintptr_t)va, (uintptr_t)va + len);
+	env_unlock(env);
+	return 0;
+}
+
+// Remove the name of segment 'name'.  Its memory is freed once no
+// environment has it mapped any more.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if name is invalid.
+//	-E_NOT_FOUND if there is no segment called 'name'.
+static int
+sys_shm_unlink(const char *uname)
+{
+	char name[SHM_NAMELEN];
+	int r;
+
+	if ((r = shm_copy_name(name, uname)) < 0)
+		return r;
+	return shm_unlink(name);
+}
+
 // Try to send 'value' to the target env 'envid'.
-// If srcva < UTOP, then also send page currently mapped at 'srcva',
-// so that receiver gets a duplicate mapping of the same page.
+// If srcva < UTOP, then also send the 'npages' pages currently mapped
+// from 'srcva' on, so that the receiver gets duplicate mappings of the
+// same pages, in the window it asked for in sys_ipc_recv_range.  If the
+// window is smaller, only as many pages as fit in it are sent.  A
+// superpage is always sent whole, so it must be 4MB-aligned in both
+// address spaces and lie wholly within both the range sent and the
+// window: the send maps nothing the receiver did not offer.
 //
 // The send fails with a return value of -E_IPC_NOT_RECV if the
 // target is not blocked, waiting for an IPC.
@@ -310,14 +553,16 @@ sys_page_unmap(envid_t envid, void *va)
 //    env_ipc_recving is set to 0 to block future sends;
 //    env_ipc_from is set to the sending envid;
 //    env_ipc_value is set to the 'value' parameter;
-//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+//    env_ipc_perm is set to 'perm' if pages were transferred, 0 otherwise;
+//    env_ipc_npages is set to the number of pages transferred.
 // The target environment is marked runnable again, returning 0
 // from the paused sys_ipc_recv system call.  (Hint: does the
 // sys_ipc_recv function ever actually return?)
 //
-// If the sender wants to send a page but the receiver isn't asking for one,
-// then no page mapping is transferred, but no error occurs.
-// The ipc only happens when no errors occur.
+// If the sender wants to send pages but the receiver isn't asking for
+// any, then no page mapping is transferred, but no error occurs.
+// The ipc only happens when no errors occur: every page is checked,
+// and the page tables made, before any page is mapped.
 //
 // Returns 0 on success, < 0 on error.
 // Errors are:
@@ -325,82 +570,159 @@ sys_page_unmap(envid_t envid, void *va)
 //		(No need to check permissions.)
 //	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
 //		or another environment managed to send first.
-//	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
+//	-E_INVAL if srcva < UTOP but srcva is not page-aligned, or the
+//		pages do not fit below UTOP.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
-//	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
-//		address space.
-//	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
+//	-E_INVAL if srcva < UTOP but a page to send is not mapped in the
+//		caller's address space.
+//	-E_INVAL if (perm & PTE_W), but a page to send is read-only in the
 //		current environment's address space.
-//	-E_NO_MEM if there's not enough memory to map srcva in envid's
+//	-E_INVAL if a superpage to send is not aligned in the source or
+//		in the window, or it reaches past the range sent or the
+//		window.
+//	-E_NO_MEM if there's not enough memory to map the pages in envid's
 //		address space.
 static int
-sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+sys_ipc_try_send_range(envid_t envid, uint32_t value, void *srcva,
+		       size_t npages, unsigned perm)
 {
-	// LAB 4: Your code here.
 	struct Env *src = curenv, *dst;
+	struct PageInfo *pp;
+	pte_t *pte;
+	uintptr_t va, dstva;
+	size_t n = 0, max, i, step;
+	int r = 0;
 
 	if (envid2env(envid, &dst, false) < 0)
 		return -E_BAD_ENV;
-	if (!dst->env_ipc_recving)
-		return -E_IPC_NOT_RECV;
-
-	dst->env_ipc_perm = 0;
-	if (srcva < (void *)UTOP && dst->env_ipc_dstva < (void *)UTOP) {
-		if (srcva != ROUNDDOWN(srcva, PGSIZE))
-			return -E_INVAL;
-		if (perm & ~PTE_SYSCALL)
-			return -E_INVAL;
-
-		struct PageInfo *psrc;
-		pte_t *src_pte;
-
-		if (!(psrc = page_lookup(src->env_pgdir, srcva, &src_pte)))
-			return -E_INVAL;
-		if ((perm & PTE_W) && !(*src_pte & PTE_W))
-			return -E_INVAL;
-		if (page_insert(dst->env_pgdir, psrc, dst->env_ipc_dstva, perm) < 0)
-			return -E_NO_MEM;
-		dst->env_ipc_perm = perm;
+
+	env_lock_pair(src, dst);
+	if (!env_is(dst, envid)) {
+		r = -E_BAD_ENV;
+		goto out;
+	}
+	if (!dst->env_ipc_recving || dst->env_status != ENV_NOT_RUNNABLE) {
+		r = -E_IPC_NOT_RECV;
+		goto out;
+	}
+
+	if (srcva < (void *)UTOP && npages && dst->env_ipc_dstva < (void *)UTOP) {
+		if (srcva != ROUNDDOWN(srcva, PGSIZE) ||
+		    npages > (UTOP - (uintptr_t)srcva) / PGSIZE ||
+		    (perm & ~PTE_SYSCALL)) {
+			r = -E_INVAL;
+			goto out;
+		}
+		dstva = (uintptr_t)dst->env_ipc_dstva;
+		max = MIN(npages, dst->env_ipc_npages);
+
+		// Check the whole range before mapping any of it.
+		for (i = 0; i < max; i += step) {
+			va = (uintptr_t)srcva + i * PGSIZE;
+			if (!(pp = page_lookup(src->env_pgdir, (void *)va, &pte)) ||
+			    ((perm & PTE_W) && !(*pte & PTE_W)) ||
+			    ((*pte & PTE_PS) &&
+			     (SPGOFF(va) || SPGOFF(dstva + i * PGSIZE) ||
+			      i + NPTENTRIES > max))) {
+				r = -E_INVAL;
+				goto out;
+			}
+			step = (*pte & PTE_PS) ? NPTENTRIES : 1;
+		}
+		n = i;
+
+		// Make the page tables first, so that running out of
+		// memory leaves the receiver's window as it was.
+		if ((r = vma_add(dst, dstva, dstva + n * PGSIZE)) < 0)
+			goto out;
+		for (i = 0; i < n; i += step) {
+			page_lookup(src->env_pgdir, srcva + i * PGSIZE, &pte);
+			step = (*pte & PTE_PS) ? NPTENTRIES : 1;
+			if (step == 1 &&
+			    !pgdir_walk(dst->env_pgdir,
+					(void *)(dstva + i * PGSIZE), 1)) {
+				r = -E_NO_MEM;
+				goto out;
+			}
+		}
+
+		// Only a page replacing a superpage of the receiver's
+		// can still need a new page table.  If that fails, undo
+		// just the pages mapped here.
+		for (i = 0; i < n; i += step) {
+			pp = page_lookup(src->env_pgdir, srcva + i * PGSIZE, &pte);
+			step = (*pte & PTE_PS) ? NPTENTRIES : 1;
+			if ((r = page_insert(dst->env_pgdir, pp,
+					     (void *)(dstva + i * PGSIZE),
+					     perm)) < 0) {
+				vma_unmap(dst, dstva, dstva + i * PGSIZE);
+				goto out;
+			}
+		}
 	}
 
 	dst->env_ipc_recving = 0;
 	dst->env_ipc_from = src->env_id;
 	dst->env_ipc_value = value;
+	dst->env_ipc_perm = n ? perm : 0;
+	dst->env_ipc_npages = n;
 	dst->env_status = ENV_RUNNABLE;
 	dst->env_tf.tf_regs.reg_eax = 0;
+	sched_enqueue(dst);
 
-	return 0;
+out:
+	env_unlock_pair(src, dst);
+	return r;
+}
+
+// sys_ipc_try_send_range of one page.
+static int
+sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	return sys_ipc_try_send_range(envid, value, srcva, 1, perm);
 }
 
 // Block until a value is ready.  Record that you want to receive
-// using the env_ipc_recving and env_ipc_dstva fields of struct Env,
-// mark yourself not runnable, and then give up the CPU.
+// using the env_ipc_recving, env_ipc_dstva and env_ipc_npages fields of
+// struct Env, mark yourself not runnable, and then give up the CPU.
 //
-// If 'dstva' is < UTOP, then you are willing to receive a page of data.
-// 'dstva' is the virtual address at which the sent page should be mapped.
+// If 'dstva' is < UTOP and 'npages' is not 0, then you are willing to
+// receive up to 'npages' pages of data, mapped from 'dstva' on.
 //
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
-//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned, or the
+//		window does not fit below UTOP.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv_range(void *dstva, size_t npages)
 {
-	// LAB 4: Your code here.
-	curenv->env_ipc_dstva = (void *)UTOP;
-	if (dstva < (void *)UTOP) {
-		if (dstva != ROUNDDOWN(dstva, PGSIZE))
-			return -E_INVAL;
-		curenv->env_ipc_dstva = dstva;
-	}
+	if (dstva >= (void *)UTOP || !npages) {
+		dstva = (void *)UTOP;
+		npages = 0;
+	} else if (dstva != ROUNDDOWN(dstva, PGSIZE) ||
+		   npages > (UTOP - (uintptr_t)dstva) / PGSIZE)
+		return -E_INVAL;
 
+	env_lock(curenv);
+	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_npages = npages;
 	curenv->env_ipc_recving = true;
-	curenv->env_status = ENV_NOT_RUNNABLE;
+	if (curenv->env_status == ENV_RUNNING)
+		curenv->env_status = ENV_NOT_RUNNABLE;
+	env_unlock(curenv);
 
 	return 0;
 }
 
+// sys_ipc_recv_range of one page.
+static int
+sys_ipc_recv(void *dstva)
+{
+	return sys_ipc_recv_range(dstva, 1);
+}
+
 static int
 sys_exec(envid_t envid)
 {
@@ -408,6 +730,11 @@ sys_exec(envid_t envid)
 	if (envid2env(envid, &child, true) < 0)
 		return -E_BAD_ENV;
 
+	env_lock_pair(curenv, child);
+	if (child == curenv || !env_is(child, envid)) {
+		env_unlock_pair(curenv, child);
+		return -E_BAD_ENV;
+	}
 	return env_exec(curenv, child);
 }
 
@@ -423,8 +750,13 @@ sys_time_msec(void)
 static int
 sys_packet_transmit(const void *packet, int len)
 {
+	int r;
+
 	user_mem_assert(curenv, packet, len, PTE_P);
-	return e1000_packet_transmit(packet, len);
+	env_lock(curenv);
+	r = e1000_packet_transmit(packet, len);
+	env_unlock(curenv);
+	return r;
 }
 
 static int
@@ -433,17 +765,79 @@ sys_packet_receive(void *packet)
 	int r;
 	user_mem_assert(curenv, packet, PGSIZE, PTE_P | PTE_W);
 
-	if ((r = packet_receive(curenv->env_pgdir, packet)) == E1000_RECV_SUCCESS)
+	// Holding our own lock keeps the e1000 interrupt from looking
+	// at us between the check and going to sleep.
+	env_lock(curenv);
+	if ((r = packet_receive(curenv, packet)) == E1000_RECV_SUCCESS) {
+		env_unlock(curenv);
 		return 0;
+	}
 	if (r < 0)
 		panic("e1000_packet_receive");
 
 	curenv->env_net_recving = true;
 	curenv->env_net_recv_packet = packet;
-	curenv->env_status = ENV_NOT_RUNNABLE;
+	if (curenv->env_status == ENV_RUNNING)
+		curenv->env_status = ENV_NOT_RUNNABLE;
+	env_unlock(curenv);
 	return 0;
 }
 
+// Run the 'n' system calls in 'calls' in order, in one kernel entry,
+// and store each one's return value in its mc_result.  Stops at the
+// first call that returns < 0.  Calls that block or do not return to
+// the caller (sys_yield, sys_ipc_recv, sys_packet_receive, sys_exec,
+// and sys_multicall itself), and sys_exofork and sys_fork, whose child
+// would resume in the middle of the batch, are refused with -E_INVAL.
+//
+// The calls are copied in first and the results copied out at the
+// end, and only if 'calls' is still writable then: a call in the
+// batch may unmap the batch or make it read-only.  If it made the
+// batch copy-on-write, as fork does, the env gets its own copy first.
+//
+// Returns the number of calls that succeeded, so calls[ret] holds
+// the error if ret < n, or < 0 on error.  Errors are:
+//	-E_INVAL if n < 0 or n > MULTICALL_MAX.
+// The environment is destroyed if 'calls' is not readable and
+// writable by it.
+static int
+sys_multicall(struct Multicall *calls, int n)
+{
+	struct Multicall mc[MULTICALL_MAX];
+	int i;
+
+	if (n < 0 || n > MULTICALL_MAX)
+		return -E_INVAL;
+	user_mem_assert(curenv, calls, n * sizeof(*calls), PTE_U | PTE_W);
+	memcpy(mc, calls, n * sizeof(*calls));
+
+	for (i = 0; i < n; i++) {
+		switch (mc[i].mc_num) {
+		case SYS_yield:
+		case SYS_ipc_recv:
+		case SYS_ipc_recv_range:
+		case SYS_packet_receive:
+		case SYS_exec:
+		case SYS_exofork:
+		case SYS_fork:
+		case SYS_multicall:
+			mc[i].mc_result = -E_INVAL;
+			break;
+		default:
+			mc[i].mc_result = syscall(mc[i].mc_num, mc[i].mc_args[0],
+						  mc[i].mc_args[1], mc[i].mc_args[2],
+						  mc[i].mc_args[3], mc[i].mc_args[4]);
+		}
+		if (mc[i].mc_result < 0)
+			break;
+	}
+
+	vma_populate(curenv, calls, n * sizeof(*calls), true);
+	if (user_mem_check(curenv, calls, n * sizeof(*calls), PTE_U | PTE_W) == 0)
+		memcpy(calls, mc, MIN(i + 1, n) * sizeof(*calls));
+	return i;
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -471,6 +865,9 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_exofork: {
 		return sys_exofork();
 	} break;
+	case SYS_fork: {
+		return sys_fork();
+	} break;
 	case SYS_env_set_status: {
 		return sys_env_set_status((int32_t)a1, (int)a2);
 	} break;
@@ -483,6 +880,21 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_page_unmap: {
 		return sys_page_unmap((int32_t)a1, (void *)a2);
 	} break;
+	case SYS_mmap: {
+		return sys_mmap((envid_t)a1, (void *)a2, (size_t)a3, (int)a4);
+	} break;
+	case SYS_shm_create: {
+		return sys_shm_create((const char *)a1, (size_t)a2);
+	} break;
+	case SYS_shm_attach: {
+		return sys_shm_attach((envid_t)a1, (const char *)a2, (void *)a3, (int)a4);
+	} break;
+	case SYS_shm_detach: {
+		return sys_shm_detach((envid_t)a1, (void *)a2, (size_t)a3);
+	} break;
+	case SYS_shm_unlink: {
+		return sys_shm_unlink((const char *)a1);
+	} break;
 	case SYS_env_set_pgfault_upcall: {
 		return sys_env_set_pgfault_upcall((envid_t)a1, (void *)a2);
 	} break;
@@ -492,6 +904,14 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_ipc_recv: {
 		return sys_ipc_recv((void *)a1);
 	} break;
+	case SYS_ipc_try_send_range: {
+		return sys_ipc_try_send_range((envid_t)a1, (uint32_t)a2,
+					      (void *)a3, (size_t)a4,
+					      (unsigned)a5);
+	} break;
+	case SYS_ipc_recv_range: {
+		return sys_ipc_recv_range((void *)a1, (size_t)a2);
+	} break;
 	case SYS_env_set_trapframe: {
 		return sys_env_set_trapframe((envid_t)a1, (struct Trapframe *)a2);
 	}
@@ -501,6 +921,15 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_time_msec: {
 		return sys_time_msec();
 	}
+	case SYS_env_set_quantum: {
+		return sys_env_set_quantum((envid_t)a1, a2);
+	}
+	case SYS_env_set_priority: {
+		return sys_env_set_priority((envid_t)a1, (int)a2);
+	}
+	case SYS_multicall: {
+		return sys_multicall((struct Multicall *)a1, (int)a2);
+	}
 	case SYS_packet_transmit: {
 		return sys_packet_transmit((const uint8_t *)a1, (unsigned int)a2);
 	}
@@ -1,33 +1,84 @@
+#include <inc/x86.h>
+#include <inc/time.h>
+#include <inc/string.h>
 #include <kern/time.h>
 #include <kern/cpu.h>
 #include <inc/assert.h>
 
-static unsigned int ticks;
+// PIT channel 2 is the reference clock for calibrating the TSC and
+// the LAPIC timer.  It can count down once without raising an
+// interrupt, and its output is readable through the speaker port.
+#define PIT_HZ		1193182
+#define PIT_CH2		0x42
+#define PIT_CMD		0x43
+#define PIT_GATE	0x61	// bit 0: ch2 gate, bit 1: speaker, bit 5: ch2 out
 
+// The time page, allocated by mem_init and mapped at UTIME.
+struct TimePage *timepage;
+
+// Start a PIT_CALIBRATE_MS countdown on PIT channel 2.
 void
-time_init(void)
+pit_calibrate_start(void)
+{
+	uint32_t count = PIT_HZ * PIT_CALIBRATE_MS / 1000;
+	uint8_t gate;
+
+	// Gate off and speaker off; channel 2, mode 0 (interrupt on
+	// terminal count), binary, low byte then high byte.  Raising
+	// the gate starts the count.
+	gate = inb(PIT_GATE) & ~0x03;
+	outb(PIT_GATE, gate);
+	outb(PIT_CMD, 0xB0);
+	outb(PIT_CH2, count & 0xFF);
+	outb(PIT_CH2, count >> 8);
+	outb(PIT_GATE, gate | 0x01);
+}
+
+// Has the countdown started by pit_calibrate_start finished?
+bool
+pit_calibrate_done(void)
 {
-	ticks = 0;
+	return inb(PIT_GATE) & 0x20;
 }
 
-// This should be called once per timer interrupt.  A timer interrupt
-// fires every 10 ms.
+// Measure the TSC frequency and fill in the time page.  Time starts
+// now.
 void
-time_tick(void)
+time_init(void)
 {
-	static unsigned char curr_ticks = 0;
+	uint64_t start, cycles;
+	uint32_t khz;
+
+	pit_calibrate_start();
+	start = read_tsc();
+	while (!pit_calibrate_done())
+		;
+	cycles = read_tsc() - start;
 
-	if (++curr_ticks == ncpu) {
-		curr_ticks = 0;
-		ticks++;
+	khz = cycles / PIT_CALIBRATE_MS;
+	if (!khz) {
+		cprintf("time: TSC calibration failed\n");
+		khz = 1000000;
 	}
+	cprintf("TSC runs at %u.%03u MHz\n", khz / 1000, khz % 1000);
 
-	if (ticks * 10 < ticks)
-		panic("time_tick: time overflowed");
+	memset(timepage, 0, PGSIZE);
+	timepage->tp_tsc = start;
+	timepage->tp_nsec = 0;
+	timepage->tp_mult = (1000000ULL << 32) / khz;
+	timepage->tp_tsc_khz = khz;
+}
+
+// Nanoseconds since time_init.
+uint64_t
+time_nsec(void)
+{
+	return timepage->tp_nsec +
+	       tsc_to_nsec(read_tsc() - timepage->tp_tsc, timepage->tp_mult);
 }
 
 unsigned int
 time_msec(void)
 {
-	return ticks * 10;
+	return time_nsec() / 1000000;
 }
@@ -4,8 +4,18 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
+// Length of a PIT calibration countdown.
+#define PIT_CALIBRATE_MS 10
+
+extern struct TimePage *timepage;
+
+void pit_calibrate_start(void);
+bool pit_calibrate_done(void);
+
 void time_init(void);
-void time_tick(void);
+uint64_t time_nsec(void);
 unsigned int time_msec(void);
 
 #endif /* JOS_KERN_TIME_H */
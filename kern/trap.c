@@ -15,7 +15,9 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/fpu.h>
 #include <kern/time.h>
+#include <kern/vma.h>
 
 static struct Taskstate ts;
 
@@ -59,6 +61,10 @@ trapname(int trapno)
 		return excnames[trapno];
 	if (trapno == T_SYSCALL)
 		return "System call";
+	if (trapno == T_RESCHED)
+		return "Reschedule IPI";
+	if (trapno == T_TLBFLUSH)
+		return "TLB shootdown IPI";
 	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
 		return "Hardware Interrupt";
 	return "(unknown trap)";
@@ -83,6 +89,9 @@ void trap_align();
 void trap_mchk();
 void trap_simderr();
 void trap_syscall();
+void trap_resched();
+void trap_tlbflush();
+void sysenter_handler();
 void trap_irq();
 
 void trap_irq_timer();
@@ -118,6 +127,8 @@ trap_init(void)
 	SETGATE(idt[T_SIMDERR], 0, GD_KT, trap_simderr, 0);
 
 	SETGATE(idt[T_SYSCALL], 0, GD_KT, trap_syscall, 3);
+	SETGATE(idt[T_RESCHED], 0, GD_KT, trap_resched, 0);
+	SETGATE(idt[T_TLBFLUSH], 0, GD_KT, trap_tlbflush, 0);
 
 	SETGATE(idt[IRQ_OFFSET + IRQ_TIMER], 0, GD_KT, trap_irq_timer, 0);
 	SETGATE(idt[IRQ_OFFSET + IRQ_KBD], 0, GD_KT, trap_irq_kbd, 0);
@@ -170,6 +181,16 @@ trap_init_percpu(void)
 	// bottom three bits are special; we leave them 0)
 	ltr(GD_TSS0 + (cpunum() << 3));
 
+	fpu_init_percpu();
+
+	// Set up sysenter to enter at sysenter_handler on the same
+	// kernel stack.
+	if (sysenter_supported()) {
+		wrmsr(MSR_SYSENTER_CS, GD_KT);
+		wrmsr(MSR_SYSENTER_ESP, thiscpu->cpu_ts.ts_esp0);
+		wrmsr(MSR_SYSENTER_EIP, (uint32_t)sysenter_handler);
+	}
+
 	// Load the IDT
 	lidt(&idt_pd);
 }
@@ -227,6 +248,7 @@ trap_dispatch(struct Trapframe *tf)
 	switch (tf->tf_trapno) {
 	case T_PGFLT: {
 		page_fault_handler(tf);
+		return;
 	} break;
 	case T_DEBUG: {
 		if (!(read_dr6() & (1 << 14)))
@@ -238,6 +260,12 @@ trap_dispatch(struct Trapframe *tf)
 		monitor(tf);
 		return;
 	} break;
+	case T_DEVICE: {
+		if ((tf->tf_cs & 3) != 3)
+			panic("kernel used the FPU");
+		fpu_trap();
+		return;
+	} break;
 	case T_SYSCALL: {
 		int32_t err = syscall(tf->tf_regs.reg_eax, tf->tf_regs.reg_edx, tf->tf_regs.reg_ecx,
 				      tf->tf_regs.reg_ebx, tf->tf_regs.reg_edi, tf->tf_regs.reg_esi);
@@ -264,7 +292,20 @@ trap_dispatch(struct Trapframe *tf)
 	// triggered on every CPU.
 	// LAB 6: Your code here.
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
-		time_tick();
+		lapic_eoi();
+		sched_tick();
+		return;
+	}
+
+	// Another CPU queued work while this one was halted.  Returning
+	// to trap() reschedules.
+	if (tf->tf_trapno == T_RESCHED) {
+		lapic_eoi();
+		return;
+	}
+
+	if (tf->tf_trapno == T_TLBFLUSH) {
+		tlb_shootdown_recv();
 		lapic_eoi();
 		return;
 	}
@@ -275,12 +316,18 @@ trap_dispatch(struct Trapframe *tf)
 		irq_eoi();
 
 		for (i = 0; i < NENV; i++) {
-			if (envs[i].env_net_recving &&
-			    !packet_receive(envs[i].env_pgdir, envs[i].env_net_recv_packet)) {
+			if (!envs[i].env_net_recving)
+				continue;
+			env_lock(&envs[i]);
+			if (envs[i].env_net_recving && envs[i].env_status == ENV_NOT_RUNNABLE &&
+			    !packet_receive(&envs[i], envs[i].env_net_recv_packet)) {
 				envs[i].env_net_recving = false;
 				envs[i].env_status = ENV_RUNNABLE;
+				sched_enqueue(&envs[i]);
+				env_unlock(&envs[i]);
 				break;
 			}
+			env_unlock(&envs[i]);
 		}
 		return;
 	}
@@ -301,6 +348,7 @@ trap_dispatch(struct Trapframe *tf)
 	if (tf->tf_cs == GD_KT)
 		panic("unhandled trap in kernel");
 	else {
+		env_lock(curenv);
 		env_destroy(curenv);
 		return;
 	}
@@ -318,9 +366,9 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acqurie the big kernel lock if we were halted in
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-		lock_kernel();
+	// Note that this CPU is busy again if it was halted
+	xchg(&thiscpu->cpu_status, CPU_STARTED);
+
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -328,18 +376,12 @@ trap(struct Trapframe *tf)
 
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
-		// LAB 4: Your code here.
 		assert(curenv);
-		lock_kernel();
 
-		// Garbage collect if current enviroment is a zombie
-		if (curenv->env_status == ENV_DYING) {
-			env_free(curenv);
-			curenv = NULL;
+		// Garbage collect if current enviroment is a zombie.
+		// The scheduler frees it once it has switched away.
+		if (curenv->env_status == ENV_DYING)
 			sched_yield();
-		}
 
 		// Copy trap frame (which is currently on the stack)
 		// into 'curenv->env_tf', so that running the environment
@@ -356,19 +398,93 @@ trap(struct Trapframe *tf)
 	// Dispatch based on what type of trap occurred
 	trap_dispatch(tf);
 
+	// Other CPUs drop whatever mappings the trap changed under
+	// them before we go on.
+	tlb_shootdown();
+
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
 	// if doing so makes sense.
-	if (curenv && curenv->env_status == ENV_RUNNING)
-		env_run(curenv);
-	else
+	if (curenv) {
+		env_lock(curenv);
+		if (curenv->env_status == ENV_RUNNING)
+			env_run(curenv);
+		env_unlock(curenv);
+	}
+	sched_yield();
+}
+
+// Flags a system call stub treats as clobbered.
+#define SYSEXIT_FLAGS (FL_CF | FL_PF | FL_AF | FL_ZF | FL_SF | FL_OF)
+
+// Return to user mode with sysexit, which takes the return address
+// in %edx and the stack pointer in %ecx.  The user stub expects both
+// registers to be clobbered, and does not need its flags restored.
+static void __attribute__((noreturn))
+sysexit_pop_tf(struct Trapframe *tf)
+{
+	asm volatile("movw %%ax,%%gs\n"
+		     "\tmovw %%ax,%%fs" ::"a"(GD_UD | 3));
+	asm volatile("movl %0,%%esp\n"
+		     "\tpopal\n"
+		     "\tpopl %%es\n"
+		     "\tpopl %%ds\n"
+		     "\tmovl 0x8(%%esp),%%edx\n"  /* tf_eip */
+		     "\tmovl 0x14(%%esp),%%ecx\n" /* tf_esp */
+		     "\tsti\n"
+		     "\tsysexit"
+		     :
+		     : "g"(tf)
+		     : "memory");
+	panic("sysexit failed");
+}
+
+// System calls made with sysenter arrive here from sysenter_handler.
+// This is the T_SYSCALL part of trap(), plus a cheaper way back: if
+// the env can simply continue where it called from, leave with
+// sysexit instead of iret.  System calls with a fifth argument
+// always use int $T_SYSCALL, since the stub needs %esi and %ebp.
+void
+sysenter_trap(struct Trapframe *tf)
+{
+	extern char *panicstr;
+	uintptr_t ret_eip;
+
+	if (panicstr)
+		asm volatile("hlt");
+	assert(curenv);
+	if (curenv->env_status == ENV_DYING)
 		sched_yield();
+
+	curenv->env_tf = *tf;
+	tf = &curenv->env_tf;
+	last_tf = tf;
+	ret_eip = tf->tf_eip;
+	tf->tf_regs.reg_eax = syscall(tf->tf_regs.reg_eax, tf->tf_regs.reg_edx,
+				      tf->tf_regs.reg_ecx, tf->tf_regs.reg_ebx,
+				      tf->tf_regs.reg_edi, 0);
+	tlb_shootdown();
+
+	env_lock(curenv);
+	if (curenv->env_status == ENV_RUNNING) {
+		// sysexit restores neither flags nor a changed frame
+		// (sys_exec, sys_env_set_trapframe on itself).
+		if (tf->tf_eip == ret_eip && tf->tf_cs == (GD_UT | 3) &&
+		    (tf->tf_eflags & ~SYSEXIT_FLAGS) == (FL_IF | 0x2)) {
+			env_unlock(curenv);
+			sysexit_pop_tf(tf);
+		}
+		env_run(curenv);
+	}
+	env_unlock(curenv);
+	sched_yield();
 }
 
 void
 page_fault_handler(struct Trapframe *tf)
 {
 	uint32_t fault_va;
+	int r;
 
 	// Read processor's CR2 register to find the faulting address
 	fault_va = rcr2();
@@ -412,6 +528,22 @@ page_fault_handler(struct Trapframe *tf)
 
 	// LAB 4: Your code here.
 
+	// Copy-on-write and demand-zero pages are resolved right here;
+	// the upcall only sees the faults the kernel does not own.
+	if (!(tf->tf_err & FEC_PR)) {
+		env_lock(curenv);
+		r = vma_fault(curenv, fault_va, tf->tf_err & FEC_WR);
+		env_unlock(curenv);
+		if (r == 0)
+			return;
+	} else if (tf->tf_err & FEC_WR) {
+		env_lock(curenv);
+		r = page_cow(curenv->env_pgdir, (void *)fault_va);
+		env_unlock(curenv);
+		if (r == 0)
+			return;
+	}
+
 	// Destroy the environment that caused the fault.
 	if (curenv->env_pgfault_upcall) {
 		uintptr_t xesp = UXSTACKTOP - (sizeof(int32_t) + sizeof(struct UTrapframe));
@@ -433,10 +565,12 @@ page_fault_handler(struct Trapframe *tf)
 		tf->tf_eip = (uintptr_t)curenv->env_pgfault_upcall;
 		tf->tf_esp = xesp;
 
-		env_run(curenv);
+		// trap() resumes curenv at the upcall
+		return;
 	}
 
 	cprintf("[%08x] user fault va %08x ip %08x\n", curenv->env_id, fault_va, tf->tf_eip);
 	print_trapframe(tf);
+	env_lock(curenv);
 	env_destroy(curenv);
 }
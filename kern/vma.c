@@ -0,0 +1,322 @@
+// Mapped regions of user address spaces.
+//
+// Each env keeps a sorted list of disjoint regions (env_vmas) that
+// cover every page it has mapped below UTOP, and every page table it
+// has there.  The regions may cover more than is mapped, but never
+// less, so a walk over an address space only has to look inside them:
+// teardown, fork and exec cost time in proportion to what is mapped,
+// not to the size of the address space.
+//
+// Mappings of user pages go through vma_page_insert and
+// vma_page_remove, or vma_add before filling in page tables directly.
+// The env's lock guards its list, like its page tables.
+//
+// A region with a vm_perm is demand-zero memory reserved by sys_mmap:
+// its pages are mapped only when first touched (see vma_fault).
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/env.h>
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/kmalloc.h>
+#include <kern/vma.h>
+
+static struct KmemCache vma_cache;
+
+// Mapped, copy-on-write, wherever demand-zero memory is read before it
+// is written.  Holds a reference of its own, so it is never freed.
+struct PageInfo *vma_zero_page;
+
+void
+vma_init(void)
+{
+	kmem_cache_init(&vma_cache, "vma", sizeof(struct Vma), NULL);
+	if (!(vma_zero_page = page_alloc(ALLOC_ZERO)))
+		panic("vma_init: out of memory");
+	page_incref(vma_zero_page);
+}
+
+// Make sure every page of [start, end) lies in one of e's regions:
+// the gaps between the regions already there get regions of 'perm'.
+// Neighbours of the same perm are merged.
+// Returns 0 on success, -E_NO_MEM if out of memory, in which case only
+// some of the gaps may have been filled.
+static int
+vma_cover(struct Env *e, uintptr_t start, uintptr_t end, int perm)
+{
+	struct Vma **pv, *v, *n;
+	uintptr_t va = start;
+	int r = 0;
+
+	for (pv = &e->env_vmas; (v = *pv) && v->vm_end < start;
+	     pv = &v->vm_next)
+		;
+	while (va < end) {
+		if (v && v->vm_start <= va) {
+			va = MAX(va, v->vm_end);
+			pv = &v->vm_next;
+			v = *pv;
+			continue;
+		}
+		if (!(n = kmem_cache_alloc(&vma_cache))) {
+			r = -E_NO_MEM;
+			break;
+		}
+		n->vm_start = va;
+		n->vm_end = va = v ? MIN(v->vm_start, end) : end;
+		n->vm_perm = perm;
+		n->vm_next = v;
+		*pv = n;
+		pv = &n->vm_next;
+	}
+
+	for (v = e->env_vmas; v && v->vm_start <= end;) {
+		n = v->vm_next;
+		if (n && v->vm_end == n->vm_start && v->vm_perm == n->vm_perm) {
+			v->vm_end = n->vm_end;
+			v->vm_next = n->vm_next;
+			kmem_cache_free(&vma_cache, n);
+		} else
+			v = n;
+	}
+	return r;
+}
+
+//
+// Add [start, end) to e's regions, for pages about to be mapped.
+// Returns 0 on success, -E_NO_MEM if out of memory.
+//
+int
+vma_add(struct Env *e, uintptr_t start, uintptr_t end)
+{
+	return vma_cover(e, start, end, 0);
+}
+
+// Take [start, end) out of e's regions.  If a region would have to be
+// split but there is no memory for that, it is left whole, which only
+// means it covers more than is mapped, and -E_NO_MEM is returned.
+static int
+vma_del(struct Env *e, uintptr_t start, uintptr_t end)
+{
+	struct Vma **pv, *v, *n;
+
+	for (pv = &e->env_vmas; (v = *pv) && v->vm_start < end;) {
+		if (v->vm_end <= start) {
+			pv = &v->vm_next;
+		} else if (v->vm_start >= start && v->vm_end <= end) {
+			*pv = v->vm_next;
+			kmem_cache_free(&vma_cache, v);
+		} else if (v->vm_start < start && v->vm_end > end) {
+			if (!(n = kmem_cache_alloc(&vma_cache)))
+				return -E_NO_MEM;
+			n->vm_start = end;
+			n->vm_end = v->vm_end;
+			n->vm_perm = v->vm_perm;
+			n->vm_next = v->vm_next;
+			v->vm_end = start;
+			v->vm_next = n;
+			return 0;
+		} else {
+			if (v->vm_start < start)
+				v->vm_end = start;
+			else
+				v->vm_start = end;
+			pv = &v->vm_next;
+		}
+	}
+	return 0;
+}
+
+// The region of e that holds va, if any.
+static struct Vma *
+vma_find(struct Env *e, uintptr_t va)
+{
+	struct Vma *v;
+
+	for (v = e->env_vmas; v && v->vm_end <= va; v = v->vm_next)
+		;
+	return v && v->vm_start <= va ? v : NULL;
+}
+
+// Whether any of e's regions overlaps [start, end).
+static bool
+vma_overlaps(struct Env *e, uintptr_t start, uintptr_t end)
+{
+	struct Vma *v;
+
+	for (v = e->env_vmas; v && v->vm_start < end; v = v->vm_next)
+		if (v->vm_end > start)
+			return true;
+	return false;
+}
+
+//
+// Give dst the regions of src below 'end'.  dst must have none yet.
+// Returns 0 on success, -E_NO_MEM if out of memory.
+//
+int
+vma_dup(struct Env *dst, struct Env *src, uintptr_t end)
+{
+	struct Vma *v, *n, **pn = &dst->env_vmas;
+
+	assert(!dst->env_vmas);
+	for (v = src->env_vmas; v && v->vm_start < end; v = v->vm_next) {
+		if (!(n = kmem_cache_alloc(&vma_cache)))
+			return -E_NO_MEM;
+		n->vm_start = v->vm_start;
+		n->vm_end = MIN(v->vm_end, end);
+		n->vm_perm = v->vm_perm;
+		n->vm_next = NULL;
+		*pn = n;
+		pn = &n->vm_next;
+	}
+	return 0;
+}
+
+//
+// Unmap everything e has mapped in [start, end), and free the page
+// tables that no region needs any more.  Superpages that [start, end)
+// only partly covers are unmapped as a whole.
+// Returns 0 on success, -E_NO_MEM if a region could not be split, in
+// which case all of it stays (still with its vm_perm), though nothing
+// in [start, end) is mapped any more.
+//
+int
+vma_unmap(struct Env *e, uintptr_t start, uintptr_t end)
+{
+	struct Vma *v;
+	uintptr_t s, t, va, pt;
+
+	for (v = e->env_vmas; v && v->vm_start < end; v = v->vm_next) {
+		s = MAX(v->vm_start, start);
+		t = MIN(v->vm_end, end);
+		for (pt = ROUNDDOWN(s, PTSIZE); pt < t; pt += PTSIZE) {
+			if (!(e->env_pgdir[PDX(pt)] & PTE_P))
+				continue;
+			if ((e->env_pgdir[PDX(pt)] & PTE_PS) ||
+			    (pt >= start && pt + PTSIZE <= end)) {
+				page_remove_pde(e->env_pgdir, (void *)pt);
+				continue;
+			}
+			for (va = MAX(pt, s); va < MIN(pt + PTSIZE, t);
+			     va += PGSIZE)
+				page_remove(e->env_pgdir, (void *)va);
+			// The page table stays if what is left of the
+			// regions still reaches into it.
+			if (!(pt < start &&
+			      vma_overlaps(e, pt, MIN(start, pt + PTSIZE))) &&
+			    !(end < pt + PTSIZE &&
+			      vma_overlaps(e, MAX(end, pt), pt + PTSIZE)))
+				page_remove_pde(e->env_pgdir, (void *)pt);
+		}
+	}
+	return vma_del(e, start, end);
+}
+
+//
+// page_insert for a user page of env e.
+//
+int
+vma_page_insert(struct Env *e, struct PageInfo *pp, void *va, int perm)
+{
+	size_t size = pp->pp_order == SP_ORDER ? PTSIZE : PGSIZE;
+	int r;
+
+	if ((r = vma_add(e, (uintptr_t)va, (uintptr_t)va + size)) < 0)
+		return r;
+	return page_insert(e->env_pgdir, pp, va, perm);
+}
+
+//
+// page_remove for a user page of env e.  A superpage goes as a whole.
+//
+void
+vma_page_remove(struct Env *e, void *va)
+{
+	uintptr_t start = ROUNDDOWN((uintptr_t)va, PGSIZE);
+	size_t size = PGSIZE;
+
+	if (e->env_pgdir[PDX(va)] & PTE_PS) {
+		start = ROUNDDOWN((uintptr_t)va, PTSIZE);
+		size = PTSIZE;
+	}
+	vma_unmap(e, start, start + size);
+}
+
+//
+// Reserve [start, end) in e as demand-zero memory with permissions
+// 'perm', unmapping whatever was there.
+// Returns 0 on success, -E_NO_MEM if out of memory.
+//
+int
+vma_map(struct Env *e, uintptr_t start, uintptr_t end, int perm)
+{
+	int r;
+
+	assert(perm);
+	// vma_cover leaves alone what is still covered, so the old
+	// regions must be gone first.
+	if ((r = vma_unmap(e, start, end)) < 0 ||
+	    (r = vma_cover(e, start, end, perm)) < 0)
+		vma_unmap(e, start, end);
+	return r;
+}
+
+//
+// Resolves a fault at 'va' on a page of a demand-zero region of e that
+// is not mapped yet.  A read maps the shared zero page, copy-on-write
+// if the region is writable; a write, or any access to a PTE_SHARE
+// region, maps a fresh zeroed page.  The caller holds e's lock.
+//
+// RETURNS:
+//   0 on success
+//   -E_FAULT, if 'va' is mapped, not demand-zero, or not writable
+//   -E_NO_MEM, if there is no memory for the page
+//
+int
+vma_fault(struct Env *e, uintptr_t va, bool write)
+{
+	struct Vma *v = vma_find(e, va);
+	struct PageInfo *pp;
+	pte_t *pte;
+	int perm, r;
+
+	if (!v || !v->vm_perm || (write && !(v->vm_perm & PTE_W)))
+		return -E_FAULT;
+	va = ROUNDDOWN(va, PGSIZE);
+	if ((pte = pgdir_walk(e->env_pgdir, (void *)va, 0)) && (*pte & PTE_P))
+		return -E_FAULT;
+
+	if (!write && !(v->vm_perm & PTE_SHARE)) {
+		perm = v->vm_perm & ~PTE_W;
+		if (v->vm_perm & PTE_W)
+			perm |= PTE_COW;
+		return page_insert(e->env_pgdir, vma_zero_page, (void *)va,
+				   perm);
+	}
+
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+	if ((r = page_insert(e->env_pgdir, pp, (void *)va, v->vm_perm)) < 0)
+		page_free(pp);
+	return r;
+}
+
+//
+// Maps the demand-zero pages of [va, va+len) in e that are not mapped
+// yet, and for a write copies the copy-on-write ones, for the kernel to
+// access them on e's behalf.  Takes e's lock.
+//
+void
+vma_populate(struct Env *e, const void *va, size_t len, bool write)
+{
+	uintptr_t p;
+
+	env_lock(e);
+	for (p = ROUNDDOWN((uintptr_t)va, PGSIZE); p < (uintptr_t)va + len;
+	     p += PGSIZE)
+		if (vma_fault(e, p, write) < 0 && write)
+			page_cow(e->env_pgdir, (void *)p);
+	env_unlock(e);
+}
@@ -0,0 +1,33 @@
+#ifndef JOS_KERN_VMA_H
+#define JOS_KERN_VMA_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+struct PageInfo;
+
+// A page-aligned range [vm_start, vm_end) of user addresses.
+struct Vma {
+	uintptr_t vm_start;
+	uintptr_t vm_end;
+	int vm_perm;		// Demand-zero page perms, or 0
+	struct Vma *vm_next;	// Next region up
+};
+
+// The page of zeros that demand-zero memory reads
+extern struct PageInfo *vma_zero_page;
+
+void vma_init(void);
+int vma_add(struct Env *e, uintptr_t start, uintptr_t end);
+int vma_dup(struct Env *dst, struct Env *src, uintptr_t end);
+int vma_unmap(struct Env *e, uintptr_t start, uintptr_t end);
+int vma_page_insert(struct Env *e, struct PageInfo *pp, void *va, int perm);
+void vma_page_remove(struct Env *e, void *va);
+int vma_map(struct Env *e, uintptr_t start, uintptr_t end, int perm);
+int vma_fault(struct Env *e, uintptr_t va, bool write);
+void vma_populate(struct Env *e, const void *va, size_t len, bool write);
+
+#endif	// !JOS_KERN_VMA_H
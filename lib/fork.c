@@ -3,10 +3,6 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW 0x800
-
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
@@ -52,27 +48,34 @@ pgfault(struct UTrapframe *utf)
 // copy-on-write again if it was already copy-on-write at the beginning of
 // this function?)
 //
+// The mappings are queued on 'b'; the two for a copy-on-write page
+// always run in the same kernel entry, so we cannot write the page
+// between them.
+//
+// If pn is the first page of a superpage, the whole superpage is
+// mapped, going by its PDE (its uvpt slots hold no PTEs).
+//
 // Returns: 0 on success, < 0 on error.
 // It is also OK to panic on error.
 //
 static int
-duppage(envid_t envid, unsigned pn)
+duppage(struct McBatch *b, envid_t envid, unsigned pn)
 {
 	int r;
 
 	// LAB 4: Your code here.
-	void *addr = (void *)(pn * PGSIZE);
-
-	if (uvpt[pn] & PTE_SHARE || !(uvpt[pn] & (PTE_COW | PTE_W)))
-		sys_page_map(0, addr, envid, addr, uvpt[pn] & PTE_SYSCALL);
-	else {
-		if ((r = sys_page_map(0, addr, envid, addr,
-				      PTE_P | PTE_U | PTE_COW)) < 0)
-			panic("sys_page_map child: %e", r);
-		if ((r = sys_page_map(0, addr, 0, addr,
-				      PTE_P | PTE_U | PTE_COW)) < 0)
-			panic("sys_page_map parent: %e", r);
-	}
+	uint32_t addr = pn * PGSIZE;
+	pte_t pte = (uvpd[PDX(addr)] & PTE_PS) ? uvpd[PDX(addr)] : uvpt[pn];
+
+	if (pte & PTE_SHARE || !(pte & (PTE_COW | PTE_W)))
+		return mc_add(b, SYS_page_map, 0, addr, envid, addr,
+			      pte & PTE_SYSCALL);
+	if ((r = mc_reserve(b, 2)) < 0 ||
+	    (r = mc_add(b, SYS_page_map, 0, addr, envid, addr,
+			PTE_P | PTE_U | PTE_COW)) < 0 ||
+	    (r = mc_add(b, SYS_page_map, 0, addr, 0, addr,
+			PTE_P | PTE_U | PTE_COW)) < 0)
+		panic("duppage: %e", r);
 	return 0;
 }
 
@@ -96,11 +99,18 @@ envid_t
 fork(void)
 {
 	// LAB 4: Your code here.
+	struct McBatch b;
 	int r, pn;
 	uintptr_t addr;
 
 	set_pgfault_handler(pgfault);
-	envid_t child = sys_exofork();
+	// The kernel copies the address space in one go if it can; one
+	// without sys_fork rejects it as an unknown system call.
+	envid_t child = sys_fork();
+	if (child == -E_INVAL)
+		child = sys_exofork();
+	else if (child > 0)
+		return child;
 	if (child < 0)
 		panic("fork: %e", child);
 
@@ -111,20 +121,27 @@ fork(void)
 		return child;
 	}
 
+	// Copy the mappings, and finish setting up the child, in
+	// batches of system calls.
+	mc_init(&b);
 	for (addr = 0; addr < USTACKTOP; addr += PGSIZE) {
-		if ((uvpd[PDX(addr)] & PTE_P) && (uvpt[PGNUM(addr)] & PTE_P))
-			duppage(child, PGNUM(addr));
+		if (uvpd[PDX(addr)] & PTE_PS) {
+			duppage(&b, child, PGNUM(addr));
+			addr += PTSIZE - PGSIZE;
+		} else if ((uvpd[PDX(addr)] & PTE_P) &&
+			   (uvpt[PGNUM(addr)] & PTE_P))
+			duppage(&b, child, PGNUM(addr));
 	}
 
 	// allocate an exception stack with writable user permissions
-	if ((r = sys_page_alloc(child, (void *)(UXSTACKTOP - PGSIZE),
-				PTE_P | PTE_U | PTE_W)) < 0)
-		panic("sys_page_alloc: %e", r);
-
 	extern void _pgfault_upcall();
-	sys_env_set_pgfault_upcall(child, _pgfault_upcall);
-
-	sys_env_set_status(child, ENV_RUNNABLE);
+	if ((r = mc_add(&b, SYS_page_alloc, child, UXSTACKTOP - PGSIZE,
+			PTE_P | PTE_U | PTE_W, 0, 0)) < 0 ||
+	    (r = mc_add(&b, SYS_env_set_pgfault_upcall, child,
+			(uint32_t)_pgfault_upcall, 0, 0, 0)) < 0 ||
+	    (r = mc_add(&b, SYS_env_set_status, child, ENV_RUNNABLE, 0, 0, 0)) < 0 ||
+	    (r = mc_flush(&b)) < 0)
+		panic("fork: %e", r);
 	return child;
 }
 
@@ -132,6 +149,7 @@ fork(void)
 int
 sfork(void)
 {
+	struct McBatch b;
 	int r, pn;
 	uintptr_t addr;
 
@@ -144,27 +162,34 @@ sfork(void)
 		return child;
 	}
 
+	mc_init(&b);
 	for (addr = 0; addr < USTACKTOP; addr += PGSIZE) {
 		if (addr == USTACKTOP - PGSIZE)
 			continue;
-		if ((uvpd[PDX(addr)] & PTE_P) && (uvpt[PGNUM(addr)] & PTE_P)) {
+		if (uvpd[PDX(addr)] & PTE_PS) {
+			if ((r = mc_add(&b, SYS_page_map, 0, addr, child, addr,
+					PTE_P | PTE_U |
+						(uvpd[PDX(addr)] & PTE_W))) < 0)
+				panic("sys_page_map child: %e", r);
+			addr += PTSIZE - PGSIZE;
+		} else if ((uvpd[PDX(addr)] & PTE_P) &&
+			   (uvpt[PGNUM(addr)] & PTE_P)) {
 			pn = PGNUM(addr);
-			if ((r = sys_page_map(
-				     0, (void *)addr, child, (void *)addr,
-				     PTE_P | PTE_U | (uvpt[pn] & PTE_W))) < 0)
+			if ((r = mc_add(&b, SYS_page_map, 0, addr, child, addr,
+					PTE_P | PTE_U | (uvpt[pn] & PTE_W))) < 0)
 				panic("sys_page_map child: %e", r);
 		}
 	}
 
-	duppage(child, PGNUM(USTACKTOP - PGSIZE));
+	duppage(&b, child, PGNUM(USTACKTOP - PGSIZE));
 	// allocate an exception stack with writable user permissions
-	if ((r = sys_page_alloc(child, (void *)(UXSTACKTOP - PGSIZE),
-				PTE_P | PTE_U | PTE_W)) < 0)
-		panic("sys_page_alloc: %e", r);
-
 	extern void _pgfault_upcall();
-	sys_env_set_pgfault_upcall(child, _pgfault_upcall);
-
-	sys_env_set_status(child, ENV_RUNNABLE);
+	if ((r = mc_add(&b, SYS_page_alloc, child, UXSTACKTOP - PGSIZE,
+			PTE_P | PTE_U | PTE_W, 0, 0)) < 0 ||
+	    (r = mc_add(&b, SYS_env_set_pgfault_upcall, child,
+			(uint32_t)_pgfault_upcall, 0, 0, 0)) < 0 ||
+	    (r = mc_add(&b, SYS_env_set_status, child, ENV_RUNNABLE, 0, 0, 0)) < 0 ||
+	    (r = mc_flush(&b)) < 0)
+		panic("sfork: %e", r);
 	return child;
 }
@@ -69,6 +69,57 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	} while (err);
 }
 
+// Like ipc_send, but sends the 'npages' pages mapped from 'pg' on, all
+// in one go.  The receiver gets as many of them as fit in the window it
+// passed to ipc_recv_range.
+void
+ipc_send_range(envid_t to_env, uint32_t val, void *pg, size_t npages,
+	       int perm)
+{
+	int err;
+	if (!pg)
+		pg = (void *)KERNBASE;
+
+	do {
+		err = sys_ipc_try_send_range(to_env, val, pg, npages, perm);
+		if (err && err != -E_IPC_NOT_RECV)
+			panic("ipc_send_range %d", err);
+		if (err)
+			sys_yield();
+	} while (err);
+}
+
+// Like ipc_recv, but takes up to 'npages' pages, mapped from 'pg' on.
+// If 'npages_store' is nonnull, then store the number of pages mapped
+// in *npages_store (0 on error).
+int32_t
+ipc_recv_range(envid_t *from_env_store, void *pg, size_t npages,
+	       int *perm_store, size_t *npages_store)
+{
+	int err;
+	if (!pg)
+		pg = (void *)KERNBASE;
+
+	if ((err = sys_ipc_recv_range(pg, npages)) < 0) {
+		if (from_env_store)
+			*from_env_store = 0;
+		if (perm_store)
+			*perm_store = 0;
+		if (npages_store)
+			*npages_store = 0;
+		return err;
+	}
+
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+	if (npages_store)
+		*npages_store = thisenv->env_ipc_npages;
+
+	return thisenv->env_ipc_value;
+}
+
 // Find the first environment of the given type.  We'll use this to
 // find special environments.
 // Returns 0 if no such environment exists.
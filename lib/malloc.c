@@ -41,6 +41,7 @@ isfree(void *v, size_t n)
 void*
 malloc(size_t n)
 {
+	struct McBatch b;
 	int i, cont;
 	int nwrap;
 	uint32_t *ref;
@@ -94,15 +95,27 @@ malloc(size_t n)
 
 	/*
 	 * allocate at mptr - the +4 makes sure we allocate a ref count.
+	 * the pages are demand-zero: only those written get memory.
+	 * the continued ones are read once, which maps the kernel's
+	 * zero page there, so their PTE_CONTINUED shows in uvpt.
 	 */
-	for (i = 0; i < n + 4; i += PGSIZE){
-		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
-		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont) < 0){
-			for (; i >= 0; i -= PGSIZE)
-				sys_page_unmap(0, mptr + i);
-			return 0;	/* out of physical memory */
-		}
+	i = ROUNDUP(n + 4, PGSIZE);
+	mc_init(&b);
+	if (i > PGSIZE)
+		mc_add(&b, SYS_mmap, 0, (uint32_t) mptr, i - PGSIZE,
+		       PTE_P|PTE_U|PTE_W|PTE_CONTINUED, 0);
+	mc_add(&b, SYS_mmap, 0, (uint32_t) (mptr + i - PGSIZE), PGSIZE,
+	       PTE_P|PTE_U|PTE_W, 0);
+	if (mc_flush(&b) < 0) {
+		mc_init(&b);
+		for (i = 0; i < n + 4; i += PGSIZE)
+			mc_add(&b, SYS_page_unmap, 0, (uint32_t) (mptr + i),
+			       0, 0, 0);
+		mc_flush(&b);
+		return 0;	/* out of physical memory */
 	}
+	for (cont = 0; cont < i - PGSIZE; cont += PGSIZE)
+		(void) *(volatile uint8_t *) (mptr + cont);
 
 	ref = (uint32_t*) (mptr + i - 4);
 	*ref = 2;	/* reference for mptr, reference for returned block */
@@ -114,6 +127,7 @@ malloc(size_t n)
 void
 free(void *v)
 {
+	struct McBatch b;
 	uint8_t *c;
 	uint32_t *ref;
 
@@ -123,11 +137,13 @@ free(void *v)
 
 	c = ROUNDDOWN(v, PGSIZE);
 
+	mc_init(&b);
 	while (uvpt[PGNUM(c)] & PTE_CONTINUED) {
-		sys_page_unmap(0, c);
+		mc_add(&b, SYS_page_unmap, 0, (uint32_t) c, 0, 0, 0);
 		c += PGSIZE;
 		assert(mbegin <= c && c < mend);
 	}
+	mc_flush(&b);
 
 	/*
 	 * c is just a piece of this page, so dec the ref count
@@ -0,0 +1,69 @@
+// Batching system calls through sys_multicall.
+
+#include <inc/lib.h>
+
+void
+mc_init(struct McBatch *b)
+{
+	b->mb_n = 0;
+}
+
+// Queue a system call.  Calls run in the order they were queued, when
+// the batch fills up or at the next mc_flush.  The result of a queued
+// call is not available, so only queue calls whose failure the caller
+// handles as a whole.
+//
+// Returns 0, or the first error from running the batch if it was full.
+int
+mc_add(struct McBatch *b, uint32_t num, uint32_t a1, uint32_t a2,
+       uint32_t a3, uint32_t a4, uint32_t a5)
+{
+	struct Multicall *mc;
+	int r;
+
+	if (b->mb_n == MULTICALL_MAX && (r = mc_flush(b)) < 0)
+		return r;
+	mc = &b->mb_calls[b->mb_n++];
+	mc->mc_num = num;
+	mc->mc_args[0] = a1;
+	mc->mc_args[1] = a2;
+	mc->mc_args[2] = a3;
+	mc->mc_args[3] = a4;
+	mc->mc_args[4] = a5;
+	mc->mc_result = 0;
+	return 0;
+}
+
+// Make sure the next 'n' calls queued run in the same kernel entry,
+// by running the batch now if they would not fit.
+//
+// Returns 0, or the first error from running the batch.
+int
+mc_reserve(struct McBatch *b, int n)
+{
+	assert(n <= MULTICALL_MAX);
+	if (b->mb_n + n > MULTICALL_MAX)
+		return mc_flush(b);
+	return 0;
+}
+
+// Run the queued calls with one kernel entry.  Stops at the first
+// call that fails; the calls after it are dropped.
+//
+// Returns 0 on success, or the failing call's error.  That is -E_FAULT
+// if the kernel could not report it because the batch itself became
+// read-only.
+int
+mc_flush(struct McBatch *b)
+{
+	int n = b->mb_n, r;
+
+	b->mb_n = 0;
+	if (n == 0)
+		return 0;
+	if ((r = sys_multicall(b->mb_calls, n)) < 0)
+		return r;
+	if (r < n)
+		return b->mb_calls[r].mc_result < 0 ? b->mb_calls[r].mc_result : -E_FAULT;
+	return 0;
+}
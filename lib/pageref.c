@@ -7,6 +7,9 @@ pageref(void *v)
 
 	if (!(uvpd[PDX(v)] & PTE_P))
 		return 0;
+	// A superpage's references are counted on its first page.
+	if (uvpd[PDX(v)] & PTE_PS)
+		return pages[PGNUM(uvpd[PDX(v)])].pp_ref;
 	pte = uvpt[PGNUM(v)];
 	if (!(pte & PTE_P))
 		return 0;
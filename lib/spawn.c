@@ -261,10 +261,14 @@ error:
 	return r;
 }
 
+// Page allocations and mappings are batched with sys_multicall: each
+// page read from the file costs one kernel entry, blank pages almost
+// none.
 static int
 map_segment(envid_t child, uintptr_t va, size_t memsz, int fd, size_t filesz,
 	    off_t fileoffset, int perm)
 {
+	struct McBatch b;
 	int i, r;
 	void *blk;
 
@@ -277,28 +281,33 @@ map_segment(envid_t child, uintptr_t va, size_t memsz, int fd, size_t filesz,
 		fileoffset -= i;
 	}
 
+	mc_init(&b);
 	for (i = 0; i < memsz; i += PGSIZE) {
 		if (i >= filesz) {
 			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void *)(va + i),
-						perm)) < 0)
+			if ((r = mc_add(&b, SYS_page_alloc, child, va + i,
+					perm, 0, 0)) < 0)
 				return r;
 		} else {
 			// from file
-			if ((r = sys_page_alloc(0, UTEMP,
-						PTE_P | PTE_U | PTE_W)) < 0)
+			if ((r = mc_add(&b, SYS_page_alloc, 0, (uint32_t)UTEMP,
+					PTE_P | PTE_U | PTE_W, 0, 0)) < 0 ||
+			    (r = mc_flush(&b)) < 0)
 				return r;
 			if ((r = seek(fd, fileoffset + i)) < 0)
 				return r;
 			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz - i))) < 0)
 				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void *)(va + i),
-					      perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
+			// A flush here may report an earlier blank
+			// page's failure.
+			if ((r = mc_reserve(&b, 2)) < 0)
+				return r;
+			mc_add(&b, SYS_page_map, 0, (uint32_t)UTEMP, child,
+			       va + i, perm);
+			mc_add(&b, SYS_page_unmap, 0, (uint32_t)UTEMP, 0, 0, 0);
 		}
 	}
-	return 0;
+	return mc_flush(&b);
 }
 
 // Copy the mappings for shared pages into the child address space.
@@ -306,14 +315,24 @@ static int
 copy_shared_pages(envid_t child)
 {
 	// LAB 5: Your code here.
-	void *addr;
-	for (addr = 0; addr < (void *)USTACKTOP; addr += PGSIZE) {
-		if ((uvpd[PDX(addr)] & PTE_P) && (uvpt[PGNUM(addr)] & PTE_P) &&
-		    (uvpt[PGNUM(addr)] & PTE_SHARE))
-			sys_page_map(0, addr, child, addr,
-				     uvpt[(uint32_t)addr / PGSIZE] &
-					     PTE_SYSCALL);
+	struct McBatch b;
+	uintptr_t addr;
+
+	mc_init(&b);
+	for (addr = 0; addr < USTACKTOP; addr += PGSIZE) {
+		if (uvpd[PDX(addr)] & PTE_PS) {
+			// a superpage is shared as a whole
+			if (uvpd[PDX(addr)] & PTE_SHARE)
+				mc_add(&b, SYS_page_map, 0, addr, child, addr,
+				       uvpd[PDX(addr)] & PTE_SYSCALL);
+			addr += PTSIZE - PGSIZE;
+		} else if ((uvpd[PDX(addr)] & PTE_P) &&
+			   (uvpt[PGNUM(addr)] & PTE_P) &&
+			   (uvpt[PGNUM(addr)] & PTE_SHARE))
+			mc_add(&b, SYS_page_map, 0, addr, child, addr,
+			       uvpt[PGNUM(addr)] & PTE_SYSCALL);
 	}
+	mc_flush(&b);
 
 	return 0;
 }
@@ -2,12 +2,37 @@
 
 #include <inc/syscall.h>
 #include <inc/lib.h>
+#include <inc/x86.h>
+
+// Whether to enter the kernel with sysenter: 1 yes, 0 no, -1 not
+// yet known.  The kernel sets sysenter up on every CPU that has it.
+static int use_sysenter = -1;
 
 static inline int32_t
 syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
 	int32_t ret;
 
+	if (use_sysenter < 0)
+		use_sysenter = sysenter_supported();
+
+	// Fast system call: system call number in AX, up to four
+	// parameters in DX, CX, BX, DI.  The kernel comes back with
+	// sysexit to the address in SI on the stack in BP, and
+	// clobbers CX and DX.  Calls with a fifth parameter need SI
+	// for it, so they trap instead.
+	if (use_sysenter && a5 == 0) {
+		asm volatile("pushl %%ebp\n"
+			     "\tmovl %%esp,%%ebp\n"
+			     "\tleal 1f,%%esi\n"
+			     "\tsysenter\n"
+			     "1:\tpopl %%ebp\n"
+			     : "=a"(ret), "+d"(a1), "+c"(a2)
+			     : "0"(num), "b"(a3), "D"(a4)
+			     : "esi", "cc", "memory");
+		goto out;
+	}
+
 	// Generic system call: pass system call number in AX,
 	// up to five parameters in DX, CX, BX, DI, SI.
 	// Interrupt kernel with T_SYSCALL.
@@ -25,6 +50,7 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		     : "i"(T_SYSCALL), "a"(num), "d"(a1), "c"(a2), "b"(a3), "D"(a4), "S"(a5)
 		     : "cc", "memory");
 
+out:
 	if (check && ret > 0)
 		panic("syscall %d returned %d (> 0)", num, ret);
 
@@ -79,8 +105,45 @@ sys_page_unmap(envid_t envid, void *va)
 	return syscall(SYS_page_unmap, 1, envid, (uint32_t)va, 0, 0, 0);
 }
 
+int
+sys_mmap(envid_t envid, void *va, size_t len, int perm)
+{
+	return syscall(SYS_mmap, 1, envid, (uint32_t)va, len, perm, 0);
+}
+
+int
+sys_shm_create(const char *name, size_t len)
+{
+	return syscall(SYS_shm_create, 1, (uint32_t)name, len, 0, 0, 0);
+}
+
+int
+sys_shm_attach(envid_t envid, const char *name, void *va, int perm)
+{
+	return syscall(SYS_shm_attach, 1, envid, (uint32_t)name, (uint32_t)va,
+		       perm, 0);
+}
+
+int
+sys_shm_detach(envid_t envid, void *va, size_t len)
+{
+	return syscall(SYS_shm_detach, 1, envid, (uint32_t)va, len, 0, 0);
+}
+
+int
+sys_shm_unlink(const char *name)
+{
+	return syscall(SYS_shm_unlink, 1, (uint32_t)name, 0, 0, 0, 0);
+}
+
 // sys_exofork is inlined in lib.h
 
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
 int
 sys_env_set_status(envid_t envid, int status)
 {
@@ -111,6 +174,21 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_try_send_range(envid_t envid, uint32_t value, void *srcva,
+		       size_t npages, int perm)
+{
+	return syscall(SYS_ipc_try_send_range, 0, envid, value,
+		       (uint32_t)srcva, npages, perm);
+}
+
+int
+sys_ipc_recv_range(void *dstva, size_t npages)
+{
+	return syscall(SYS_ipc_recv_range, 1, (uint32_t)dstva, npages, 0, 0,
+		       0);
+}
+
 int
 sys_exec(envid_t env)
 {
@@ -134,3 +212,21 @@ sys_packet_receive(void *packet)
 {
 	return (int)syscall(SYS_packet_receive, 0, (uint32_t)packet, 0, 0, 0, 0);
 }
+
+int
+sys_env_set_quantum(envid_t envid, uint32_t ticks)
+{
+	return syscall(SYS_env_set_quantum, 1, envid, ticks, 0, 0, 0);
+}
+
+int
+sys_env_set_priority(envid_t envid, int priority)
+{
+	return syscall(SYS_env_set_priority, 1, envid, priority, 0, 0, 0);
+}
+
+int
+sys_multicall(struct Multicall *calls, int n)
+{
+	return syscall(SYS_multicall, 0, (uint32_t)calls, n, 0, 0, 0);
+}
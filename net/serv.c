@@ -107,7 +107,7 @@ static void __attribute__((noreturn)) net_timer(uint32_t arg)
 	struct timer_thread *t = (struct timer_thread *)arg;
 
 	for (;;) {
-		uint32_t cur = sys_time_msec();
+		uint32_t cur = time_msec();
 
 		lwip_core_lock();
 		t->func();
@@ -175,9 +175,9 @@ process_timer(envid_t envid)
 		return;
 	}
 
-	start = sys_time_msec();
+	start = time_msec();
 	thread_yield();
-	now = sys_time_msec();
+	now = time_msec();
 
 	to = TIMER_INTERVAL - (now - start);
 	ipc_send(envid, to, 0, 0);
@@ -0,0 +1,64 @@
+// test that a sys_multicall batch may change its own page's mapping
+// without bringing down the kernel, and that calls that make a child
+// are refused
+
+#include <inc/lib.h>
+
+// The batch has a page to itself, so that remapping it touches nothing
+// else.
+static struct Multicall calls[PGSIZE / sizeof(struct Multicall)]
+	__attribute__((aligned(PGSIZE)));
+
+#define MAGIC 0x600DF00D
+
+// Queue a remap of the batch's page with 'perm', then a call whose
+// result shows whether the results were written back.
+static int
+remap_batch(int perm)
+{
+	memset(calls, 0, sizeof(calls));
+	calls[0].mc_num = SYS_page_map;
+	calls[0].mc_args[0] = 0;
+	calls[0].mc_args[1] = (uint32_t)calls;
+	calls[0].mc_args[2] = 0;
+	calls[0].mc_args[3] = (uint32_t)calls;
+	calls[0].mc_args[4] = perm;
+	calls[1].mc_num = SYS_getenvid;
+	calls[1].mc_result = MAGIC;
+	return sys_multicall(calls, 2);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int r;
+
+	// Read-only: both calls run, and the results are dropped.
+	if ((r = remap_batch(PTE_P | PTE_U)) != 2)
+		panic("read-only batch: %e", r);
+	if (calls[1].mc_result != MAGIC)
+		panic("results written to a read-only batch");
+	if ((r = sys_page_map(0, calls, 0, calls, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("sys_page_map: %e", r);
+
+	// Copy-on-write: the env gets a copy, which holds the results.
+	if ((r = remap_batch(PTE_P | PTE_U | PTE_COW)) != 2)
+		panic("copy-on-write batch: %e", r);
+	if (calls[1].mc_result != sys_getenvid())
+		panic("results lost from a copy-on-write batch");
+	if (!(uvpt[PGNUM(calls)] & PTE_W))
+		panic("copy-on-write batch page still read-only");
+
+	// A child made inside a batch would resume in the middle of it.
+	memset(calls, 0, sizeof(calls));
+	calls[0].mc_num = SYS_exofork;
+	calls[1].mc_num = SYS_fork;
+	if ((r = sys_multicall(calls, 1)) != 0 ||
+	    calls[0].mc_result != -E_INVAL)
+		panic("sys_exofork in a batch: %d, %e", r, calls[0].mc_result);
+	if ((r = sys_multicall(calls + 1, 1)) != 0 ||
+	    calls[1].mc_result != -E_INVAL)
+		panic("sys_fork in a batch: %d, %e", r, calls[1].mc_result);
+
+	cprintf("testmulticall: OK\n");
+}